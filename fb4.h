@@ -0,0 +1,262 @@
+/* 4bpp framebuffer drawing primitives.
+ *
+ * The emulator framebuffer, the UI overlays and the game thumbnails are
+ * all 4bpp surfaces, two pixels per byte, high nibble = left pixel. An
+ * fb4_t describes one of them: the buffer, the bytes per line, the
+ * coordinates of its first pixel (so that an overlay can be drawn using
+ * framebuffer coordinates), and a clip rectangle.
+ *
+ * Every primitive clips its area against the clip rectangle once, then
+ * writes whole bytes wherever it can: only the first and last byte of a
+ * span may need a single nibble to be preserved. The host tool
+ * host/fb4bench.c checks them against plain per-pixel versions and
+ * benchmarks them. */
+
+#include <stdint.h>
+#include <string.h>
+
+typedef struct {
+    uint8_t *buf;           // First line.
+    int stride;             // Bytes per line.
+    int x0, y0;             // Coordinates of the first pixel, x0 even.
+    int cx1, cy1, cx2, cy2; // Clip rectangle, inclusive.
+} fb4_t;
+
+// Return the address of the byte holding the pixel x,y (no clipping).
+#define fb4_addr(fb,x,y) \
+    ((fb)->buf + ((y)-(fb)->y0)*(fb)->stride + (((x)-(fb)->x0)>>1))
+
+// Set 'fb' to the whole surface 'buf' of width x height pixels, with the
+// first pixel at x0,y0 and 'stride' bytes per line.
+void fb4_init(fb4_t *fb, uint8_t *buf, int stride, int x0, int y0,
+              int width, int height)
+{
+    fb->buf = buf;
+    fb->stride = stride;
+    fb->x0 = x0;
+    fb->y0 = y0;
+    fb->cx1 = x0;
+    fb->cy1 = y0;
+    fb->cx2 = x0+width-1;
+    fb->cy2 = y0+height-1;
+}
+
+// Clip the rectangle x1,y1 - x2,y2 (inclusive) against the clip area of
+// 'fb'. Returns 0 if nothing is left to draw.
+static inline int fb4_clip(const fb4_t *fb, int *x1, int *y1, int *x2, int *y2) {
+    if (*x1 < fb->cx1) *x1 = fb->cx1;
+    if (*y1 < fb->cy1) *y1 = fb->cy1;
+    if (*x2 > fb->cx2) *x2 = fb->cx2;
+    if (*y2 > fb->cy2) *y2 = fb->cy2;
+    return *x1 <= *x2 && *y1 <= *y2;
+}
+
+// Set the pixels from x1 to x2 (included) of the line 'y' to 'color',
+// writing whole bytes where possible. No clipping is done.
+static inline void fb4_span_noclip(const fb4_t *fb, int y, int x1, int x2, uint8_t color) {
+    uint8_t *line = fb->buf + (y-fb->y0)*fb->stride;
+    x1 -= fb->x0;
+    x2 -= fb->x0;
+    if (x1 & 1) {
+        line[x1>>1] = (line[x1>>1]&0xf0) | color;
+        x1++;
+    }
+    if (!(x2 & 1) && x2 >= x1) {
+        line[x2>>1] = (line[x2>>1]&0x0f) | (color<<4);
+        x2--;
+    }
+    if (x2 > x1) memset(line+(x1>>1),color*0x11,(x2-x1+1)>>1);
+}
+
+// Like fb4_span_noclip(), clipped.
+void fb4_span(const fb4_t *fb, int y, int x1, int x2, uint8_t color) {
+    if (!fb4_clip(fb,&x1,&y,&x2,&y)) return;
+    fb4_span_noclip(fb,y,x1,x2,color&0xf);
+}
+
+// Fill the rectangle at x,y of width x height pixels with 'color'.
+void fb4_fill_rect(const fb4_t *fb, int x, int y, int width, int height, uint8_t color) {
+    int x2 = x+width-1, y2 = y+height-1;
+    if (width <= 0 || height <= 0 || !fb4_clip(fb,&x,&y,&x2,&y2)) return;
+    color &= 0xf;
+    for (; y <= y2; y++) fb4_span_noclip(fb,y,x,x2,color);
+}
+
+// Draw the one pixel outline of the rectangle at x,y of width x height
+// pixels with 'color'. Sides outside the clip area are not drawn.
+void fb4_rect(const fb4_t *fb, int x, int y, int width, int height, uint8_t color) {
+    if (width <= 0 || height <= 0) return;
+    int x2 = x+width-1, y2 = y+height-1;
+    int cx1 = x, cy1 = y, cx2 = x2, cy2 = y2;
+    if (!fb4_clip(fb,&cx1,&cy1,&cx2,&cy2)) return;
+    color &= 0xf;
+    if (cy1 == y) fb4_span_noclip(fb,y,cx1,cx2,color);
+    if (cy2 == y2 && y2 != y) fb4_span_noclip(fb,y2,cx1,cx2,color);
+    if (cx1 == x) {
+        for (int py = cy1; py <= cy2; py++)
+            fb4_span_noclip(fb,py,x,x,color);
+    }
+    if (cx2 == x2 && x2 != x) {
+        for (int py = cy1; py <= cy2; py++)
+            fb4_span_noclip(fb,py,x2,x2,color);
+    }
+}
+
+// 1bpp bytes expanded to 4bpp masks: every set bit (MSB = leftmost
+// pixel) becomes a nibble set to 0xf, or with scale 2 a byte set to
+// 0xff. Used by fb4_blit_mask().
+static uint8_t Fb4Expand1[256][4];
+static uint8_t Fb4Expand2[256][8];
+static int Fb4ExpandReady = 0;
+
+static void fb4_expand_init(void) {
+    for (int bits = 0; bits < 256; bits++) {
+        for (int x = 0; x < 8; x++) {
+            if (!(bits & (0x80>>x))) continue;
+            Fb4Expand1[bits][x>>1] |= (x&1) ? 0x0f : 0xf0;
+            Fb4Expand2[bits][x] = 0xff;
+        }
+    }
+    Fb4ExpandReady = 1;
+}
+
+// Return the 4bpp mask of the pixels 2*i and 2*i+1 (relative to the left
+// of the image) of a line of the 1bpp image 'bits', 'w' pixels wide,
+// scaled 'scale' times.
+static inline uint8_t fb4_mask_byte(const uint8_t *bits, int w, int scale, int i) {
+    if (scale == 1)
+        return (2*i < w) ? Fb4Expand1[bits[i>>2]][i&3] : 0;
+    if (scale == 2)
+        return (i < w) ? Fb4Expand2[bits[i>>3]][i&7] : 0;
+    uint8_t mask = 0;
+    for (int n = 0; n < 2; n++) {
+        int sx = (2*i+n)/scale;
+        if (sx < w && (bits[sx>>3] & (0x80>>(sx&7))))
+            mask |= n ? 0x0f : 0xf0;
+    }
+    return mask;
+}
+
+// Set m[0..len-1] to the masks of the target bytes from the i-th of a
+// line of the image, shifted right by one nibble if 'odd'.
+static inline void fb4_mask_line(uint8_t *m, int len, const uint8_t *row,
+                                 int w, int scale, int i, int odd)
+{
+    if (!odd) {
+        for (int j = 0; j < len; j++) m[j] = fb4_mask_byte(row,w,scale,i+j);
+        return;
+    }
+    uint8_t prev = i > 0 ? fb4_mask_byte(row,w,scale,i-1) : 0;
+    for (int j = 0; j < len; j++) {
+        uint8_t cur = fb4_mask_byte(row,w,scale,i+j);
+        m[j] = (prev<<4) | (cur>>4);
+        prev = cur;
+    }
+}
+
+#define FB4_MAX_WIDTH 320   // Max width of the surfaces, in pixels.
+
+// Draw the 1bpp image 'bits' (w x h pixels, MSB = leftmost pixel,
+// 'bstride' bytes per line) at x,y, scaled 'scale' times: set pixels
+// are drawn with 'color', the others are left untouched. Every
+// target byte is written with a single masked store.
+void fb4_blit_mask(const fb4_t *fb, int x, int y, const uint8_t *bits,
+                   int w, int h, int bstride, uint8_t color, int scale)
+{
+    if (scale <= 0 || w <= 0 || h <= 0) return;
+    int x1 = x, y1 = y, x2 = x+w*scale-1, y2 = y+h*scale-1;
+    if (!fb4_clip(fb,&x1,&y1,&x2,&y2)) return;
+    if (!Fb4ExpandReady) fb4_expand_init();
+
+    // Target bytes to write, and the nibbles of the first and last
+    // one that are inside the clip area. With x not aligned to the
+    // target bytes, the masks are shifted right by one nibble, so the
+    // image spans one more byte.
+    int odd = (x-fb->x0)&1;
+    int b0 = (x-fb->x0)>>1;
+    int b1 = (x1-fb->x0)>>1, b2 = (x2-fb->x0)>>1;
+    int len = b2-b1+1;
+    uint8_t first = ((x1-fb->x0)&1) ? 0x0f : 0xff;
+    uint8_t last = ((x2-fb->x0)&1) ? 0xff : 0xf0;
+    uint8_t fill = (color&0xf)*0x11;
+
+    // The masks of a line of the image are computed once, and used for
+    // the 'scale' target lines it covers.
+    uint8_t m[FB4_MAX_WIDTH/2+1];
+    if (len > (int)sizeof(m)) return;
+    int line = (y1-y)/scale;        // Image line of the target line.
+    int sub = (y1-y)%scale;         // Target line inside the scaled one.
+    for (int py = y1; py <= y2; py++) {
+        if (py == y1 || sub == 0) {
+            // Constant scales for the common cases, so that the
+            // expansion is inlined without tests on 'scale'.
+            const uint8_t *row = bits + line*bstride;
+            if (scale == 1)
+                fb4_mask_line(m,len,row,w,1,b1-b0,odd);
+            else if (scale == 2)
+                fb4_mask_line(m,len,row,w,2,b1-b0,odd);
+            else
+                fb4_mask_line(m,len,row,w,scale,b1-b0,odd);
+            m[0] &= first;
+            m[len-1] &= last;
+        }
+        uint8_t *p = fb->buf + (py-fb->y0)*fb->stride + b1;
+        for (int j = 0; j < len; j++)
+            p[j] = (p[j] & ~m[j]) | (fill & m[j]);
+        if (++sub == scale) {
+            sub = 0;
+            line++;
+        }
+    }
+}
+
+// Copy the rectangle of 'src' at sx,sy of width x height pixels into
+// 'dst' at dx,dy. The rectangle is clipped against both surfaces. When
+// source and target pixels have the same alignment inside the bytes the
+// lines are copied with memcpy(), otherwise every target byte is made of
+// two source nibbles.
+void fb4_copy_rect(const fb4_t *dst, int dx, int dy,
+                   const fb4_t *src, int sx, int sy, int width, int height)
+{
+    if (width <= 0 || height <= 0) return;
+
+    // Clip against the source, then the target, moving the other side
+    // of the copy by the same amount.
+    int x1 = sx, y1 = sy, x2 = sx+width-1, y2 = sy+height-1;
+    if (!fb4_clip(src,&x1,&y1,&x2,&y2)) return;
+    dx += x1-sx; dy += y1-sy;
+    sx = x1; sy = y1;
+    int dx2 = dx+(x2-x1), dy2 = dy+(y2-y1);
+    x1 = dx; y1 = dy;
+    if (!fb4_clip(dst,&x1,&y1,&dx2,&dy2)) return;
+    sx += x1-dx; sy += y1-dy;
+    dx = x1; dy = y1;
+    width = dx2-dx+1;
+    height = dy2-dy+1;
+
+    int dbit = (dx-dst->x0)&1, sbit = (sx-src->x0)&1;
+    for (int y = 0; y < height; y++) {
+        uint8_t *d = fb4_addr(dst,dx,dy+y);
+        const uint8_t *s = fb4_addr(src,sx,sy+y);
+        int n = width;
+        if (dbit == sbit) {
+            if (dbit) {
+                *d = (*d&0xf0) | (*s&0x0f);
+                d++; s++; n--;
+            }
+            memcpy(d,s,n>>1);
+            if (n&1) d[n>>1] = (d[n>>1]&0x0f) | (s[n>>1]&0xf0);
+            continue;
+        }
+        // Different alignment. After the first target nibble, if it is
+        // a low one, the target is byte aligned and the source is not:
+        // every target byte is the low nibble of a source byte and the
+        // high nibble of the next one.
+        if (dbit) {
+            *d = (*d&0xf0) | (*s>>4);
+            d++; n--;
+        }
+        for (; n >= 2; n -= 2, s++, d++) *d = (s[0]<<4) | (s[1]>>4);
+        if (n) *d = (*d&0x0f) | (s[0]<<4);
+    }
+}
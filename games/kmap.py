@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+#
+# Compile text keymaps (game.kmap) into the binary format that the
+# emulator loads from flash (see kmap.h). Used by loadgames.py, but
+# can also be run directly to check a keymap or to produce scripted
+# input files for the host tools:
+#
+#   ./kmap.py jetpac.kmap jetpac.bin
+#
+# Text format, one row per line, '#' starts a comment:
+#
+#   left 1 KLEFT        Button -> up to two Spectrum keys.
+#   up+left 2           Two buttons pressed together -> one key.
+#                       These rows must come before the normal ones.
+#   press 10 4          Press key '4' at frame 10 (0-65535).
+#   release 11 4        Release key '4' at frame 11.
+#
+# Buttons: left, right, fire, up, down.
+# Keys: a single character (case matters, 'N' is shift+n), or one of
+# the names below, or a number such as 0x0d.
+
+import sys
+
+KMAP_VERSION = 1
+KMAP_MAX_ROWS = 64
+KMAP_MAX_MACROS = 64
+
+KEY_END = 0xff
+PRESS_AT_TICK = 0xfe
+RELEASE_AT_TICK = 0xfd
+MACRO_TICK_HI = 0xfc
+KEY_EXT = 0x80
+
+BUTTONS = {'left': 0, 'right': 1, 'fire': 2, 'up': 3, 'down': 4}
+
+KEY_NAMES = {
+    'NONE': 0, '-': 0,
+    'KFIRE': 0xff, 'KLEFT': 0xfe, 'KRIGHT': 0xfd, 'KDOWN': 0xfc, 'KUP': 0xfb,
+    'SPACE': 0x20, 'ENTER': 0x0d, 'SYMSHIFT': 0x0f, 'HASH': ord('#'),
+    'CURLEFT': 0x08, 'CURDOWN': 0x0a, 'CURUP': 0x0b, 'CURRIGHT': 0x09,
+    'EDIT': 0x07, 'DELETE': 0x0c,
+}
+
+class KeymapError(Exception):
+    pass
+
+def valid_key(code):
+    return 0x20 <= code <= 0x7e or 0x07 <= code <= 0x0f or code >= 0xfb
+
+def parse_key(tok):
+    if tok in KEY_NAMES:
+        return KEY_NAMES[tok]
+    if len(tok) == 1:
+        code = ord(tok)
+    else:
+        try:
+            code = int(tok, 0)
+        except ValueError:
+            raise KeymapError(f'unknown key "{tok}"')
+    if not valid_key(code):
+        raise KeymapError(f'invalid key "{tok}"')
+    return code
+
+def parse_button(tok):
+    if tok not in BUTTONS:
+        raise KeymapError(f'unknown button "{tok}"')
+    return BUTTONS[tok]
+
+def compile_keymap(text):
+    """Return the binary keymap for the text keymap 'text'."""
+    rows = []
+    macros = 0
+    normal_seen = False
+    for lineno, line in enumerate(text.splitlines(), 1):
+        tokens = []
+        for tok in line.split():
+            if tok.startswith('#'): break
+            tokens.append(tok)
+        if not tokens: continue
+        try:
+            op = tokens[0].lower()
+            args = tokens[1:]
+            if op in ('press', 'release'):
+                if len(args) != 2:
+                    raise KeymapError(f'{op} needs a frame and a key')
+                frame = int(args[0], 0)
+                if not 0 <= frame <= 0xffff:
+                    raise KeymapError('frame out of range')
+                key = parse_key(args[1])
+                if key == 0:
+                    raise KeymapError('macro without key')
+                if frame > 0xff:
+                    rows.append((MACRO_TICK_HI, frame >> 8, 0))
+                pin = PRESS_AT_TICK if op == 'press' else RELEASE_AT_TICK
+                rows.append((pin, frame & 0xff, key))
+                macros += 1
+            elif '+' in op:
+                if normal_seen:
+                    raise KeymapError('combo rows must come first')
+                b1, b2 = [parse_button(b) for b in op.split('+', 1)]
+                if b1 == b2 or len(args) != 1:
+                    raise KeymapError('combo needs two buttons and a key')
+                key = parse_key(args[0])
+                if key == 0:
+                    raise KeymapError('combo without key')
+                rows.append((b1 | KEY_EXT, b2, key))
+            else:
+                if not 1 <= len(args) <= 2:
+                    raise KeymapError('button needs one or two keys')
+                keys = [parse_key(k) for k in args] + [0]
+                rows.append((parse_button(op), keys[0], keys[1]))
+                normal_seen = True
+        except (KeymapError, ValueError) as e:
+            raise KeymapError(f'line {lineno}: {e}')
+
+    rows.append((KEY_END, 0, 0))
+    if len(rows) > KMAP_MAX_ROWS:
+        raise KeymapError(f'too many rows ({len(rows)} > {KMAP_MAX_ROWS})')
+    if macros > KMAP_MAX_MACROS:
+        raise KeymapError(f'too many macros ({macros} > {KMAP_MAX_MACROS})')
+    out = bytearray(b'KM' + bytes([KMAP_VERSION, len(rows)]))
+    for row in rows:
+        out += bytes(row)
+    return bytes(out)
+
+if __name__ == '__main__':
+    if len(sys.argv) != 3:
+        print(f'Usage: {sys.argv[0]} <keymap.kmap> <output.bin>')
+        sys.exit(1)
+    try:
+        with open(sys.argv[1]) as f:
+            data = compile_keymap(f.read())
+    except KeymapError as e:
+        print(f'{sys.argv[1]}: {e}')
+        sys.exit(1)
+    with open(sys.argv[2], 'wb') as f:
+        f.write(data)
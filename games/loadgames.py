@@ -1,44 +1,125 @@
 #!/usr/bin/env python3
+#
+# Pack all the .z80 games in this directory, together with their
+# keymaps (game.kmap, if any, see kmap.py) into games.bin, and load it
+# into the Pico flash memory. The image starts with a catalog that
+# the emulator reads at startup, so adding games or changing keymaps
+# does not require recompiling the emulator.
+#
+# Use --no-load to just generate games.bin (for instance to merge it
+# with the emulator UF2 file using uf2-append).
+#
+# Each game also gets a thumbnail of its screen after a few seconds of
+# play with its key macros (see thumb.h), shown by the menu. Thumbnails
+# are made by the zxthumb host tool: build the host tools first (see
+# host/README.md), or use --zxthumb <path> if they are not in
+# ../build-host, or --no-thumbs to skip them.
 
 import os
+import struct
 import subprocess
+import sys
+import tempfile
 
-# Base address for the first game in flash memory
+from kmap import compile_keymap, KeymapError
+
+# Base address for the games image in flash memory. Must match
+# GAMES_FLASH_ADDR in zx.c.
 base_address = 0x1007f100
-offset = 0
+
+CATALOG_VERSION = 1
+HEADER_LEN = 16
+ENTRY_LEN = 40
+NAME_LEN = 16
+
+THUMB_BYTES = 64 // 2 * 48     # Must match thumb.h.
+THUMB_FRAMES = 400
+
+def option(name, default=None):
+    if name in sys.argv and sys.argv.index(name) + 1 < len(sys.argv):
+        return sys.argv[sys.argv.index(name) + 1]
+    return default
+
+def make_thumb(zxthumb, z80_file, keymap):
+    """Return the thumbnail of the game, or b'' on error."""
+    with tempfile.TemporaryDirectory() as tmp:
+        out = os.path.join(tmp, 'thumb')
+        cmd = [zxthumb, z80_file, out, '--frames', str(THUMB_FRAMES)]
+        if keymap:
+            keys = os.path.join(tmp, 'keys')
+            with open(keys, 'wb') as file:
+                file.write(keymap)
+            cmd += ['--keys', keys]
+        try:
+            subprocess.run(cmd, check=True)
+            with open(out, 'rb') as file:
+                thumb = file.read()
+        except Exception as e:
+            print(f'{z80_file}: no thumbnail, {e}')
+            return b''
+    return thumb if len(thumb) == THUMB_BYTES else b''
+
+zxthumb = None
+if '--no-thumbs' not in sys.argv:
+    zxthumb = option('--zxthumb', '../build-host/host/zxthumb')
+    if not os.path.exists(zxthumb):
+        print(f'{zxthumb} not found, no thumbnails (see host/README.md).')
+        zxthumb = None
 
 # List of .z80 files sorted alphabetically
 z80_files = sorted([f for f in os.listdir('.') if f.endswith('.z80')])
 
-# Concatenate files
+# Collect games and keymaps.
+games = []
+for z80_file in z80_files:
+    base = os.path.splitext(os.path.basename(z80_file))[0]
+    name = base.capitalize()
+    if len(name) >= NAME_LEN:
+        print(f'Game name "{name}" too long, max {NAME_LEN-1} chars.')
+        exit(1)
+    with open(z80_file, 'rb') as file:
+        data = file.read()
+    keymap = b''
+    if os.path.exists(base + '.kmap'):
+        try:
+            with open(base + '.kmap') as file:
+                keymap = compile_keymap(file.read())
+        except KeymapError as e:
+            print(f'{base}.kmap: {e}')
+            exit(1)
+    thumb = make_thumb(zxthumb, z80_file, keymap) if zxthumb else b''
+    games.append((name, data, keymap, thumb))
+
+# Build the image: header, catalog entries, then the data blobs.
+entries = b''
+blobs = b''
+offset = HEADER_LEN + ENTRY_LEN * len(games)
+for name, data, keymap, thumb in games:
+    game_offset = offset + len(blobs)
+    blobs += data
+    keymap_offset = offset + len(blobs) if keymap else 0
+    blobs += keymap
+    thumb_offset = offset + len(blobs) if thumb else 0
+    blobs += thumb
+    entries += struct.pack('<16sIIIIII', name.encode(), game_offset, len(data),
+                           keymap_offset, len(keymap),
+                           thumb_offset, len(thumb))
+    print(f'{name:16} {len(data):6} bytes' +
+          (f', keymap {len(keymap)} bytes' if keymap else '') +
+          (', thumbnail' if thumb else ''))
+
+# The header has the image size, that the emulator checks the entries
+# against.
+header = b'ZXGC' + struct.pack('<HHII', CATALOG_VERSION, ENTRY_LEN,
+                               len(games), offset + len(blobs))
+
 with open('games.bin', 'wb') as bin_file:
-    for z80_file in z80_files:
-        with open(z80_file, 'rb') as file:
-            data = file.read()
-            bin_file.write(data)
+    bin_file.write(header + entries + blobs)
 
 print(">>> games.bin generated.")
 
-# Generate games_list.h
-with open('games_list.h', 'w') as h_file:
-    h_file.write('// Games on the flash memory. Check under the games directory for the\n')
-    h_file.write('// script that loads the Z80 image files into the flash memory.\n')
-    h_file.write('struct game_entry {\n')
-    h_file.write('    const char *name;\n')
-    h_file.write('    void *addr;         // Address in the flash memory.\n')
-    h_file.write('    size_t size;        // Length in bytes.\n')
-    h_file.write('    const uint8_t *map; // Keyboard mapping to use. See keys_config.h.\n')
-    h_file.write('} GamesTable[] = {\n')
-
-    for z80_file in z80_files:
-        size = os.path.getsize(z80_file)
-        name = os.path.splitext(os.path.basename(z80_file))[0].capitalize()
-        h_file.write(f'    {{"{name}", (void*){hex(base_address + offset)}, {size}, keymap_{name.lower()}}},\n')
-        offset += size
-
-    h_file.write('};\n')
-
-print(">>> games_list.h generated.")
+if '--no-load' in sys.argv:
+    exit(0)
 
 # Transfer games.bin to Raspberry Pi Pico
 try:
@@ -0,0 +1,27 @@
+# Run by ctest: make the thumbnail of every game with zxthumb, and check
+# that no pixel uses color 8, that the menu overlays treat as transparent
+# (see thumb_from_fb() in thumb.h).
+#
+#   cmake -DZXTHUMB=<zxthumb> -DGAMES=<dir> -DOUT=<dir> -P check-thumbs.cmake
+
+file(GLOB games ${GAMES}/*.z80)
+file(MAKE_DIRECTORY ${OUT})
+set(failed 0)
+foreach(game ${games})
+    get_filename_component(name ${game} NAME_WE)
+    execute_process(COMMAND ${ZXTHUMB} ${game} ${OUT}/${name}.thumb
+        RESULT_VARIABLE result)
+    if (NOT result EQUAL 0)
+        message(SEND_ERROR "${name}: zxthumb failed")
+        continue()
+    endif()
+    # Every nibble is a hex digit.
+    file(READ ${OUT}/${name}.thumb hex HEX)
+    string(REGEX MATCHALL "8" pixels "${hex}")
+    list(LENGTH pixels count)
+    if (count GREATER 0)
+        message(SEND_ERROR "${name}: ${count} transparent pixels")
+    else()
+        message(STATUS "${name}: ok")
+    endif()
+endforeach()
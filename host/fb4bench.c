@@ -0,0 +1,253 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info. */
+
+/* Checks and microbenchmarks of the fb4.h primitives. Every primitive is
+ * compared, over many random calls (surfaces with different origins and
+ * strides, clip areas, positions partially or totally outside, odd and
+ * even coordinates), with a plain version that sets one pixel at a time
+ * checking the clip area for every pixel, like the UI used to do. Then
+ * the time per call of both is reported:
+ *
+ *   fb4bench [--iterations <count>]
+ *
+ * The exit code is 1 if any primitive draws different pixels. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "fb4.h"
+
+/* =========================== Per-pixel versions =========================== */
+
+static int ref_get(const fb4_t *fb, int x, int y) {
+    const uint8_t *p = fb4_addr(fb,x,y);
+    return ((x-fb->x0)&1) ? *p&0xf : *p>>4;
+}
+
+static void ref_set(const fb4_t *fb, int x, int y, uint8_t color) {
+    if (x < fb->cx1 || x > fb->cx2 || y < fb->cy1 || y > fb->cy2) return;
+    uint8_t *p = fb4_addr(fb,x,y);
+    if ((x-fb->x0)&1)
+        *p = (*p&0xf0) | (color&0xf);
+    else
+        *p = (*p&0x0f) | (color<<4);
+}
+
+static void ref_span(const fb4_t *fb, int y, int x1, int x2, uint8_t color) {
+    for (int x = x1; x <= x2; x++) ref_set(fb,x,y,color);
+}
+
+static void ref_fill_rect(const fb4_t *fb, int x, int y, int width, int height, uint8_t color) {
+    for (int py = y; py < y+height; py++)
+        for (int px = x; px < x+width; px++) ref_set(fb,px,py,color);
+}
+
+static void ref_rect(const fb4_t *fb, int x, int y, int width, int height, uint8_t color) {
+    for (int py = y; py < y+height; py++)
+        for (int px = x; px < x+width; px++)
+            if (py == y || py == y+height-1 || px == x || px == x+width-1)
+                ref_set(fb,px,py,color);
+}
+
+static void ref_blit_mask(const fb4_t *fb, int x, int y, const uint8_t *bits,
+                          int w, int h, int bstride, uint8_t color, int scale)
+{
+    for (int py = 0; py < h*scale; py++) {
+        for (int px = 0; px < w*scale; px++) {
+            int sx = px/scale, sy = py/scale;
+            if (bits[sy*bstride+(sx>>3)] & (0x80>>(sx&7)))
+                ref_set(fb,x+px,y+py,color);
+        }
+    }
+}
+
+static void ref_copy_rect(const fb4_t *dst, int dx, int dy,
+                          const fb4_t *src, int sx, int sy, int width, int height)
+{
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int px = sx+x, py = sy+y;
+            if (px < src->cx1 || px > src->cx2 ||
+                py < src->cy1 || py > src->cy2) continue;
+            ref_set(dst,dx+x,dy+y,ref_get(src,px,py));
+        }
+    }
+}
+
+/* ================================ Checks ================================== */
+
+// The surfaces: a framebuffer like the emulator one, and an overlay
+// placed inside it, using framebuffer coordinates.
+#define FB_W 320
+#define FB_H 256
+#define OV_X 162
+#define OV_Y 34
+#define OV_W 150
+#define OV_H 90
+
+static uint8_t FbA[FB_W/2*FB_H], FbB[FB_W/2*FB_H];
+static uint8_t OvA[OV_W/2*OV_H], OvB[OV_W/2*OV_H];
+static uint8_t Src[FB_W/2*FB_H];
+
+static int rnd(int min, int max) {
+    return min + rand() % (max-min+1);
+}
+
+// Set 'fb' to the framebuffer or to the overlay, clipped to the whole
+// surface or to a random rectangle inside it.
+static void random_surface(fb4_t *fb, int overlay, uint8_t *fbuf, uint8_t *obuf) {
+    if (overlay)
+        fb4_init(fb,obuf,OV_W/2,OV_X,OV_Y,OV_W,OV_H);
+    else
+        fb4_init(fb,fbuf,FB_W/2,0,0,FB_W,FB_H);
+    if (rand() % 4) {
+        int w = fb->cx2-fb->cx1+1, h = fb->cy2-fb->cy1+1;
+        int x1 = rnd(0,w-1), x2 = rnd(x1,w-1);
+        int y1 = rnd(0,h-1), y2 = rnd(y1,h-1);
+        fb->cx2 = fb->cx1+x2; fb->cx1 += x1;
+        fb->cy2 = fb->cy1+y2; fb->cy1 += y1;
+    }
+}
+
+static void random_fill(uint8_t *buf, size_t len) {
+    for (size_t j = 0; j < len; j++) buf[j] = rand();
+}
+
+// Run 'iterations' random calls of every primitive on two copies of the
+// same surfaces. Returns the number of calls that drew differently.
+static int check(int iterations) {
+    const char *names[] = {"span","fill_rect","rect","blit_mask","copy_rect"};
+    int failed[5] = {0};
+    random_fill(Src,sizeof(Src));
+    for (int it = 0; it < iterations; it++) {
+        // Every call draws on top of the previous ones. From time to
+        // time, or after a failure, start again from random pixels.
+        if (it % 1000 == 0) {
+            random_fill(FbA,sizeof(FbA));
+            random_fill(OvA,sizeof(OvA));
+        }
+        memcpy(FbB,FbA,sizeof(FbA));
+        memcpy(OvB,OvA,sizeof(OvA));
+        int overlay = rand() & 1;
+
+        fb4_t a, b;
+        random_surface(&a,overlay,FbA,OvA);
+        b = a;
+        b.buf = overlay ? OvB : FbB;
+
+        // Coordinates around the surface, so that clipping happens.
+        int x = rnd(a.x0-40,a.cx2+8), y = rnd(a.y0-40,a.cy2+8);
+        int w = rnd(0,overlay ? OV_W+60 : 120), h = rnd(0,60);
+        uint8_t color = rand() & 0xf;
+        int test = it % 5;
+        switch(test) {
+        case 0:
+            y = rnd(a.cy1,a.cy2);
+            fb4_span(&a,y,x,x+w,color);
+            ref_span(&b,y,x,x+w,color);
+            break;
+        case 1:
+            fb4_fill_rect(&a,x,y,w,h,color);
+            ref_fill_rect(&b,x,y,w,h,color);
+            break;
+        case 2:
+            fb4_rect(&a,x,y,w,h,color);
+            ref_rect(&b,x,y,w,h,color);
+            break;
+        case 3: {
+            uint8_t bits[4*24];
+            int bw = rnd(1,32), bh = rnd(1,24), scale = rnd(1,3);
+            random_fill(bits,sizeof(bits));
+            fb4_blit_mask(&a,x,y,bits,bw,bh,4,color,scale);
+            ref_blit_mask(&b,x,y,bits,bw,bh,4,color,scale);
+            break;
+            }
+        case 4: {
+            fb4_t src;
+            fb4_init(&src,Src,FB_W/2,0,0,FB_W,FB_H);
+            if (rand() & 1) fb4_init(&src,Src,40,rnd(0,8)*2,rnd(0,9),80,100);
+            int sx = rnd(src.x0-10,src.cx2), sy = rnd(src.y0-10,src.cy2);
+            fb4_copy_rect(&a,x,y,&src,sx,sy,w,h);
+            ref_copy_rect(&b,x,y,&src,sx,sy,w,h);
+            break;
+            }
+        }
+        if (memcmp(FbA,FbB,sizeof(FbA)) || memcmp(OvA,OvB,sizeof(OvA))) {
+            failed[test]++;
+            random_fill(FbA,sizeof(FbA));
+            random_fill(OvA,sizeof(OvA));
+        }
+    }
+
+    int total = 0;
+    for (int j = 0; j < 5; j++) {
+        printf("check %-10s %s", names[j], failed[j] ? "FAILED" : "ok");
+        if (failed[j]) printf(" (%d calls)", failed[j]);
+        printf("\n");
+        total += failed[j];
+    }
+    return total;
+}
+
+/* ============================== Benchmark ================================= */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// Time 'reps' runs of 'stmt', and print the ns per call.
+#define BENCH(name, reps, stmt) do { \
+    uint64_t start = now_ns(); \
+    for (int r = 0; r < (reps); r++) { stmt; } \
+    printf("%-32s %10.1f ns\n", name, (double)(now_ns()-start)/(reps)); \
+} while(0)
+
+static void bench(void) {
+    fb4_t fb, ov, thumb;
+    fb4_init(&fb,FbA,FB_W/2,0,0,FB_W,FB_H);
+    fb4_init(&ov,OvA,OV_W/2,OV_X,OV_Y,OV_W,OV_H);
+    fb4_init(&thumb,Src,32,0,0,64,48);
+    const uint8_t *glyph = (const uint8_t*)"\x3c\x42\x99\xa1\xa1\x99\x42\x3c";
+
+    BENCH("fill_rect 150x90 (menu box)", 2000,
+        fb4_fill_rect(&ov,OV_X,OV_Y,OV_W,OV_H,r&15));
+    BENCH("  per pixel", 200,
+        ref_fill_rect(&ov,OV_X,OV_Y,OV_W,OV_H,r&15));
+    BENCH("rect 150x90", 20000,
+        fb4_rect(&ov,OV_X,OV_Y,OV_W,OV_H,r&15));
+    BENCH("  per pixel", 200,
+        ref_rect(&ov,OV_X,OV_Y,OV_W,OV_H,r&15));
+    BENCH("blit_mask 8x8 glyph, size 1", 200000,
+        fb4_blit_mask(&ov,OV_X+(r&63),OV_Y+8,glyph,8,8,1,r&15,1));
+    BENCH("  per pixel", 20000,
+        ref_blit_mask(&ov,OV_X+(r&63),OV_Y+8,glyph,8,8,1,r&15,1));
+    BENCH("blit_mask 8x8 glyph, size 2", 200000,
+        fb4_blit_mask(&ov,OV_X+(r&63),OV_Y+8,glyph,8,8,1,r&15,2));
+    BENCH("  per pixel", 20000,
+        ref_blit_mask(&ov,OV_X+(r&63),OV_Y+8,glyph,8,8,1,r&15,2));
+    BENCH("copy_rect 64x48, aligned", 20000,
+        fb4_copy_rect(&fb,32+(r&62),32,&thumb,0,0,64,48));
+    BENCH("copy_rect 64x48, unaligned", 20000,
+        fb4_copy_rect(&fb,33+(r&62),32,&thumb,0,0,64,48));
+    BENCH("  per pixel", 2000,
+        ref_copy_rect(&fb,32+(r&62),32,&thumb,0,0,64,48));
+}
+
+int main(int argc, char **argv) {
+    int iterations = 50000;
+    for (int j = 1; j < argc; j++) {
+        if (!strcmp(argv[j],"--iterations") && j+1 < argc) {
+            iterations = atoi(argv[++j]);
+        } else {
+            fprintf(stderr,"Usage: %s [--iterations <count>]\n",argv[0]);
+            exit(1);
+        }
+    }
+    srand(1234);
+    int failed = check(iterations);
+    bench();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Download the upstream z80.h of the chips project, used by the z80diff
+# differential tester as reference. Run it from any directory, then
+# configure the host build again.
+#
+# The reference is pinned, so that every run of z80diff compares against
+# the same code: host/reference.pin holds the upstream commit and the
+# SHA-256 of its z80.h, and the download is rejected if it differs.
+# Without a pin, the commit must be given as argument (a full 40 digits
+# hash, not a branch: use the one this fork started from) and the pin
+# file is written, to be committed together with the change.
+set -e
+HOST=$(dirname "$0")
+DIR=$HOST/reference
+PIN=$HOST/reference.pin
+
+if [ -f "$PIN" ]; then
+    REV=$(sed -n 's/^rev //p' "$PIN")
+    SUM=$(sed -n 's/^sha256 //p' "$PIN")
+    if [ -n "$1" ] && [ "$1" != "$REV" ]; then
+        echo "The reference is pinned to $REV in $PIN." >&2
+        exit 1
+    fi
+else
+    REV=$1
+    SUM=
+    if ! echo "$REV" | grep -Eq '^[0-9a-f]{40}$'; then
+        echo "Usage: $0 <upstream commit hash, 40 hex digits>" >&2
+        exit 1
+    fi
+fi
+
+mkdir -p "$DIR"
+curl -fL -o "$DIR/z80.h.tmp" \
+    "https://raw.githubusercontent.com/floooh/chips/$REV/chips/z80.h"
+GOT=$(sha256sum "$DIR/z80.h.tmp" | cut -d' ' -f1)
+if [ -n "$SUM" ] && [ "$GOT" != "$SUM" ]; then
+    rm -f "$DIR/z80.h.tmp"
+    echo "Checksum mismatch for z80.h at $REV: $GOT, expected $SUM" >&2
+    exit 1
+fi
+mv "$DIR/z80.h.tmp" "$DIR/z80.h"
+if [ -z "$SUM" ]; then
+    printf 'rev %s\nsha256 %s\n' "$REV" "$GOT" > "$PIN"
+    echo "Reference pinned in $PIN, commit it."
+fi
@@ -0,0 +1,26 @@
+/* The few Pico SDK definitions the emulator core needs, so that the
+ * same z80.h / zx.h code that runs on the device can be built on the
+ * host (see CMakeLists.txt in this directory).
+ *
+ * This file must be included before zx.h. */
+
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+// In the Pico SDK absolute_time_t is the time in microseconds since boot.
+typedef uint64_t absolute_time_t;
+
+static inline absolute_time_t get_absolute_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+// zx_exec() only samples the beeper into the audio buffer if the
+// device has a speaker. By default the host build does the sampling as
+// well, so that benchmarks match devices with audio, like the Tufty.
+// Build with -DZX_HOST_AUDIO=OFF to match devices without a speaker.
+#ifndef SPEAKER_PIN
+#define SPEAKER_PIN 0
+#endif
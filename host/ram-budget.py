@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+#
+# Report how the RP2040 RAM is used by the emulator firmware, reading the
+# symbols and sections of the ELF file, and check it against a budget.
+# The firmware is built copy_to_ram, so code and constant data live in
+# RAM too, not just the variables. Used by the 'ram-budget' target of
+# the firmware build, but can be run directly:
+#
+#   ./ram-budget.py build/zx.elf
+#   ./ram-budget.py build/zx.elf --min-free 16384 --top 30
+#
+# The exit code is 1 if less than --min-free bytes of RAM are left.
+# The binutils of the ARM toolchain are used (--nm / --readelf to change
+# them). If an ARM gdb is found, the emulator state is also broken down
+# by field.
+
+import argparse
+import re
+import shutil
+import subprocess
+import sys
+
+# RP2040 memories: the main RAM, and the two 4k scratch banks, where the
+# Pico SDK puts the stacks of core 0 (scratch Y) and core 1 (scratch X).
+REGIONS = [
+    ('RAM',       0x20000000, 256*1024),
+    ('SCRATCH_X', 0x20040000, 4*1024),
+    ('SCRATCH_Y', 0x20041000, 4*1024),
+]
+
+# Symbols are reported in groups, the first matching regexp wins.
+# Functions always go to the code group.
+GROUPS = [
+    ('Emulator state',  r'^EMU$'),
+    ('ROM images',      r'^dump_.*_bin$'),
+    ('Keymaps',         r'[Kk]eymap|^kmap_'),
+    ('Perf/telemetry',  r'^(Perf|Telemetry)'),
+    ('UI/display',      r'^(ui_|st77|Settings|zxpalette|font)'),
+    ('SDK/runtime',     r'^(_|tud_|tusb|usbd_|stdio|pico_|hw_|irq_|'
+                        r'alarm_|spin_|multicore_|mutex_|clock)'),
+]
+CODE_GROUP = 'Code in RAM'
+OTHER_GROUP = 'Other data'
+
+def run(cmd):
+    try:
+        return subprocess.run(cmd, check=True, capture_output=True,
+                              text=True).stdout
+    except (OSError, subprocess.CalledProcessError) as e:
+        print(f'{cmd[0]}: {e}', file=sys.stderr)
+        sys.exit(2)
+
+def region_of(addr):
+    for name, start, size in REGIONS:
+        if start <= addr < start+size:
+            return name
+    return None
+
+def load_sections(readelf, elf):
+    """Return (name, addr, size, region) of the allocated sections that
+    live in RAM."""
+    sections = []
+    pattern = re.compile(r'\]\s+(\S+)\s+\S+\s+([0-9a-f]+)\s+[0-9a-f]+\s+'
+                         r'([0-9a-f]+)\s+\S+\s+(\S*)')
+    for line in run([readelf, '-SW', elf]).splitlines():
+        m = pattern.search(line)
+        if not m or 'A' not in m.group(4):
+            continue
+        addr, size = int(m.group(2), 16), int(m.group(3), 16)
+        region = region_of(addr)
+        if region and size:
+            sections.append((m.group(1), addr, size, region))
+    return sections
+
+def load_symbols(nm, elf):
+    """Return the sized symbols in RAM as (name, addr, size, is_code), and
+    the unsized ones (linker symbols) as a name -> addr dict."""
+    sized, marks = [], {}
+    for line in run([nm, '-S', '--defined-only', elf]).splitlines():
+        f = line.split()
+        if len(f) == 4:
+            addr, size, kind, name = int(f[0], 16), int(f[1], 16), f[2], f[3]
+            if region_of(addr):
+                sized.append((name, addr, size, kind in 'tTwW'))
+        elif len(f) == 3:
+            marks[f[2]] = int(f[0], 16)
+    return sized, marks
+
+def group_of(name, is_code):
+    if is_code:
+        return CODE_GROUP
+    for group, regexp in GROUPS:
+        if re.search(regexp, name):
+            return group
+    return OTHER_GROUP
+
+def find_gdb():
+    for gdb in ('arm-none-eabi-gdb', 'gdb-multiarch'):
+        if shutil.which(gdb):
+            return gdb
+    return None
+
+def struct_fields(gdb, elf, expr, min_size):
+    """Return the top level fields of 'expr' as (name, size), using the
+    gdb 'ptype /o' layout output. Fields smaller than min_size are
+    summed into a single entry."""
+    out = subprocess.run([gdb, '-batch', '-ex', f'ptype /o {expr}', elf],
+                         capture_output=True, text=True).stdout
+    fields, small = [], 0
+    depth = 0
+    for line in out.splitlines():
+        m = re.match(r'/\*\s*\d+(?::\s*\d+)?\s*\|\s*(\d+)\s*\*/\s*(.*)', line)
+        if m and depth == 1:
+            size, decl = int(m.group(1)), m.group(2)
+            name = re.findall(r'(\w+)(?:\[[^\]]*\])*(?:\s*:\s*\d+)?\s*;?\s*{?$',
+                              decl)
+            name = name[0] if name else decl
+            if size >= min_size:
+                fields.append((name, size))
+            else:
+                small += size
+        depth += line.count('{') - line.count('}')
+    if small:
+        fields.append((f'(fields < {min_size} bytes)', small))
+    return fields
+
+def kb(n):
+    return f'{n/1024:7.1f}K'
+
+def main():
+    parser = argparse.ArgumentParser(description='RAM usage report.')
+    parser.add_argument('elf')
+    parser.add_argument('--nm', default='arm-none-eabi-nm')
+    parser.add_argument('--readelf', default='arm-none-eabi-readelf')
+    parser.add_argument('--min-free', type=int, default=8192,
+                        help='fail if fewer bytes of RAM are left free')
+    parser.add_argument('--top', type=int, default=15,
+                        help='number of largest symbols to list')
+    args = parser.parse_args()
+
+    sections = load_sections(args.readelf, args.elf)
+    symbols, marks = load_symbols(args.nm, args.elf)
+
+    print('Sections in RAM:')
+    used = {name: 0 for name, _, _ in REGIONS}
+    for name, addr, size, region in sections:
+        # The SDK reserves the heap as a section too, but it is free
+        # memory as far as the budget is concerned.
+        if name.startswith('.heap'):
+            continue
+        used[region] += size
+        print(f'  {name:24} {region:10} 0x{addr:08x} {size:8} {kb(size)}')
+
+    totals = {}
+    for name, _, size, is_code in symbols:
+        group = group_of(name, is_code)
+        totals[group] = totals.get(group, 0) + size
+    print('\nBy group:')
+    for group, size in sorted(totals.items(), key=lambda t: -t[1]):
+        print(f'  {group:24} {size:8} {kb(size)}')
+
+    # Stacks: core 0 from __StackBottom to __StackTop, core 1 from
+    # __StackOneBottom to __StackOneTop (see the SDK linker scripts).
+    print('\nStacks:')
+    for core, lo, hi in ((0, '__StackBottom', '__StackTop'),
+                         (1, '__StackOneBottom', '__StackOneTop')):
+        if lo in marks and hi in marks:
+            size = marks[hi]-marks[lo]
+            region = region_of(marks[lo]) or '?'
+            print(f'  core {core:<19} {region:10} {size:8} {kb(size)}')
+        else:
+            print(f'  core {core}: {lo}/{hi} not found')
+
+    gdb = find_gdb()
+    emu = [s for s in symbols if s[0] == 'EMU']
+    if emu:
+        print(f'\nEmulator state (EMU, {emu[0][2]} bytes):')
+        fields = struct_fields(gdb, args.elf, 'EMU', 1024) if gdb else []
+        for name, size in fields:
+            print(f'  {name:24} {size:8} {kb(size)}')
+        zx = [f for f in fields if f[0] == 'zx']
+        if zx:
+            for name, size in struct_fields(gdb, args.elf, 'EMU.zx', 1024):
+                print(f'    zx.{name:21} {size:8} {kb(size)}')
+        if not gdb:
+            print('  (no ARM gdb found, fields breakdown not available)')
+
+    print(f'\nLargest {args.top} symbols:')
+    for name, addr, size, is_code in sorted(symbols,
+                                            key=lambda s: -s[2])[:args.top]:
+        print(f'  {name:32} {group_of(name, is_code):16} {size:8}')
+
+    # Free RAM: what is left in the main RAM by the sections, heap
+    # included, since malloc() can use all of it.
+    print('\nBudget:')
+    failed = False
+    for name, _, size in REGIONS:
+        free = size-used[name]
+        print(f'  {name:10} used {used[name]:7} of {size:7}, free {free:7}'
+              f' {kb(free)}')
+    free = REGIONS[0][2]-used['RAM']
+    if free < args.min_free:
+        print(f'RAM budget exceeded: {free} bytes free, '
+              f'{args.min_free} required.')
+        failed = True
+    else:
+        print(f'RAM budget ok: {free} bytes free, {args.min_free} required.')
+    sys.exit(1 if failed else 0)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,39 @@
+/* Device configuration for the host build of zx.c. The display size is
+ * set at compile time with ZX_HOST_WIDTH / ZX_HOST_HEIGHT. */
+
+#define KEY_LEFT 0
+#define KEY_RIGHT 1
+#define KEY_FIRE 2
+#define KEY_UP 3
+#define KEY_DOWN 4
+#define get_device_button(pin_num) gpio_get(pin_num)
+
+#define SPEAKER_PIN -1
+
+#define DEFAULT_DISPLAY_SCALING 100
+#define DEFAULT_DISPLAY_BORDERS 1
+
+#define st77_use_spi
+#define st77_sck 2
+#define st77_mosi 3
+#define st77_rst -1
+#define st77_dc 6
+#define st77_cs -1
+#define spi_rate 200000000
+#define spi_phase 1
+#define spi_polarity 1
+#define spi_channel spi0
+#define st77_bl 8
+
+#ifndef ZX_HOST_WIDTH
+#define ZX_HOST_WIDTH 320
+#define ZX_HOST_HEIGHT 240
+#endif
+#define st77_width ZX_HOST_WIDTH
+#define st77_height ZX_HOST_HEIGHT
+#define st77_landscape 1
+#define st77_mirror_x 0
+#define st77_mirror_y 1
+#define st77_inversion 1
+#define st77_offset_x 0
+#define st77_offset_y 0
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+#define clk_sys 0
+
+typedef unsigned int uint;
+
+static uint32_t HostClockKhz = 125000;
+
+static inline bool set_sys_clock_khz(uint32_t khz, bool required) {
+    (void)required;
+    HostClockKhz = khz;
+    return true;
+}
+static inline uint32_t clock_get_hz(int clk) {
+    (void)clk;
+    return HostClockKhz*1000;
+}
+static inline bool check_sys_clock_khz(uint32_t khz, uint *vco,
+                                       uint *postdiv1, uint *postdiv2) {
+    *vco = khz*6; *postdiv1 = 6; *postdiv2 = 1;
+    return true;
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+#define GPIO_IN 0
+#define GPIO_OUT 1
+#define GPIO_FUNC_SPI 1
+#define GPIO_FUNC_PWM 4
+
+// Bit N set = button on pin N pressed.
+static uint32_t HostButtons;
+
+static inline void gpio_init(unsigned pin) { (void)pin; }
+static inline void gpio_set_dir(unsigned pin, int out) { (void)pin; (void)out; }
+static inline void gpio_set_dir_in_masked(uint32_t mask) { (void)mask; }
+static inline void gpio_set_function(unsigned pin, int fn) {
+    (void)pin; (void)fn;
+}
+static inline void gpio_put(unsigned pin, int value) { (void)pin; (void)value; }
+static inline void gpio_put_masked(uint32_t mask, uint32_t value) {
+    (void)mask; (void)value;
+}
+static inline int gpio_get(unsigned pin) { return (HostButtons>>pin) & 1; }
@@ -0,0 +1,13 @@
+#pragma once
+static inline unsigned pwm_gpio_to_slice_num(unsigned pin) { return pin/2; }
+static inline unsigned pwm_gpio_to_channel(unsigned pin) { return pin&1; }
+static inline void pwm_set_wrap(unsigned slice, unsigned wrap) {
+    (void)slice; (void)wrap;
+}
+static inline void pwm_set_enabled(unsigned slice, int enabled) {
+    (void)slice; (void)enabled;
+}
+static inline void pwm_set_chan_level(unsigned slice, unsigned chan,
+                                      unsigned level) {
+    (void)slice; (void)chan; (void)level;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <stdint.h>
+
+// The host has no SysTick: cycle counts of perf.h read as zero.
+typedef struct {
+    volatile uint32_t csr, rvr, cvr, calib;
+} systick_hw_t;
+static systick_hw_t HostSysTick;
+#define systick_hw (&HostSysTick)
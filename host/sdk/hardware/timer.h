@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+typedef uint64_t absolute_time_t;
+
+static inline uint64_t time_us_64(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+static inline uint32_t time_us_32(void) { return (uint32_t)time_us_64(); }
+static inline absolute_time_t get_absolute_time(void) { return time_us_64(); }
+
+// Repeating timers (pico/time.h) never fire on the host.
+typedef struct repeating_timer repeating_timer_t;
+typedef bool (*repeating_timer_callback_t)(repeating_timer_t *rt);
+struct repeating_timer {
+    repeating_timer_callback_t callback;
+    void *user_data;
+};
+static inline bool add_repeating_timer_ms(int32_t delay_ms,
+    repeating_timer_callback_t callback, void *user_data,
+    repeating_timer_t *out)
+{
+    (void)delay_ms;
+    out->callback = callback;
+    out->user_data = user_data;
+    return true;
+}
@@ -0,0 +1,3 @@
+#pragma once
+#define VREG_VOLTAGE_1_30 0
+static inline void vreg_set_voltage(int voltage) { (void)voltage; }
@@ -0,0 +1,14 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+// There is no reset on the host: the watchdog never fires.
+static inline void watchdog_enable(uint32_t delay_ms, bool pause_on_debug) {
+    (void)delay_ms; (void)pause_on_debug;
+}
+static inline void watchdog_update(void) {}
+static inline bool watchdog_caused_reboot(void) { return false; }
+static inline bool watchdog_enable_caused_reboot(void) { return false; }
+static inline void watchdog_reboot(uint32_t pc, uint32_t sp, uint32_t delay_ms) {
+    (void)pc; (void)sp; (void)delay_ms;
+}
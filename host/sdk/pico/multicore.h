@@ -0,0 +1,2 @@
+#pragma once
+static inline void multicore_launch_core1(void (*entry)(void)) { (void)entry; }
@@ -0,0 +1,4 @@
+#pragma once
+#include <stdbool.h>
+
+static inline bool stdio_usb_connected(void) { return true; }
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include "hardware/gpio.h"
+#include "hardware/timer.h"
+#include "hardware/clocks.h"
+
+#define PICO_ERROR_TIMEOUT -1
+
+static inline void sleep_us(uint64_t us) { (void)us; }
+static inline void sleep_ms(uint32_t ms) { (void)ms; }
+static inline bool stdio_init_all(void) { return true; }
+static inline int getchar_timeout_us(uint32_t us) {
+    (void)us;
+    return PICO_ERROR_TIMEOUT;
+}
+
+// Code and data placement (pico/platform.h): everything is in RAM here.
+#define __in_flash(group)
+#define __uninitialized_ram(group) group
@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+static inline bool tud_cdc_connected(void) { return false; }
+static inline uint32_t tud_cdc_write_available(void) { return 0; }
@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+#
+# Decode the binary telemetry stream of the emulator (see telemetry.h)
+# into CSV, and optionally plot it live.
+#
+#   ./telemetry.py /dev/ttyACM0 --enable > frames.csv
+#   ./telemetry.py capture.bin
+#   ./telemetry.py /dev/ttyACM0 --enable --plot
+#
+# The input is either a serial device (pyserial needed) or a file with
+# a raw capture of the serial output. Text printed by the emulator on
+# the same serial is skipped, or passed to stderr with --text.
+
+import struct
+import sys
+
+MAGIC = b'ZT'
+TYPE_FRAME = 1
+HEADER = struct.Struct('<2sBBH')    # magic, type, payload len, seq.
+CHECKSUM = struct.Struct('<H')
+
+# Must match struct telemetry_frame and the PERF_* slots of perf.h.
+PERF_SLOTS = ['decode_cyc', 'audio_cyc', 'kbd_cyc', 'keys_cyc',
+              'convert_cyc', 'xfer_cyc', 'exec_us', 'frame_us']
+FRAME = struct.Struct('<IIII%dIHHBB' % len(PERF_SLOTS))
+FRAME_FIELDS = (['tick', 'tstates', 'clock_khz', 'display_bytes'] +
+                PERF_SLOTS +
+                ['audio_pos', 'audio_wait', 'audio_notify', 'menu_active'])
+
+def fletcher16(data):
+    a = b = 0
+    for byte in data:
+        a = (a + byte) % 255
+        b = (b + a) % 255
+    return (b << 8) | a
+
+class Decoder:
+    """Feed bytes with feed(), get back the decoded records. Bytes not
+    part of a valid record are collected in self.text."""
+
+    def __init__(self):
+        self.buf = b''
+        self.text = b''
+        self.last_seq = None
+        self.dropped = 0
+
+    def feed(self, data):
+        self.buf += data
+        records = []
+        while True:
+            pos = self.buf.find(MAGIC)
+            if pos == -1:
+                # Keep a possible first magic byte at the end.
+                keep = 1 if self.buf.endswith(MAGIC[:1]) else 0
+                self.text += self.buf[:len(self.buf)-keep]
+                self.buf = self.buf[len(self.buf)-keep:]
+                break
+            self.text += self.buf[:pos]
+            self.buf = self.buf[pos:]
+            if len(self.buf) < HEADER.size:
+                break
+            _, rtype, plen, seq = HEADER.unpack_from(self.buf)
+            total = HEADER.size + plen + CHECKSUM.size
+            if len(self.buf) < total:
+                break
+            (checksum,) = CHECKSUM.unpack_from(self.buf, total - 2)
+            if fletcher16(self.buf[2:total-2]) != checksum:
+                # Not a record, or a corrupted one: skip the magic.
+                self.text += self.buf[:1]
+                self.buf = self.buf[1:]
+                continue
+            payload = self.buf[HEADER.size:total-2]
+            self.buf = self.buf[total:]
+            if self.last_seq is not None:
+                self.dropped += (seq - self.last_seq - 1) & 0xffff
+            self.last_seq = seq
+            if rtype == TYPE_FRAME and plen == FRAME.size:
+                rec = dict(zip(FRAME_FIELDS, FRAME.unpack(payload)))
+                rec['seq'] = seq
+                records.append(rec)
+        return records
+
+def open_input(path, enable):
+    if path.startswith('/dev/') or path.upper().startswith('COM'):
+        import serial
+        port = serial.Serial(path, timeout=0.1)
+        if enable: port.write(b't')
+        return lambda: port.read(4096)
+    f = open(path, 'rb')
+    return lambda: f.read(4096) or None
+
+def main():
+    args = [a for a in sys.argv[1:] if not a.startswith('--')]
+    if len(args) != 1:
+        print(f'Usage: {sys.argv[0]} <serial device | capture file> '
+              '[--enable] [--plot] [--text]', file=sys.stderr)
+        sys.exit(1)
+    enable = '--enable' in sys.argv
+    show_text = '--text' in sys.argv
+
+    plot = None
+    if '--plot' in sys.argv:
+        plot = LivePlot()
+
+    read = open_input(args[0], enable)
+    dec = Decoder()
+    print(','.join(['seq'] + FRAME_FIELDS))
+    try:
+        while True:
+            data = read()
+            if data is None: break
+            for rec in dec.feed(data):
+                print(','.join(str(rec[f]) for f in ['seq'] + FRAME_FIELDS))
+                if plot: plot.add(rec)
+            if show_text and dec.text:
+                sys.stderr.write(dec.text.decode(errors='replace'))
+            dec.text = b''
+            if plot: plot.refresh()
+    except KeyboardInterrupt:
+        pass
+    print(f'{dec.dropped} records dropped by the device', file=sys.stderr)
+
+class LivePlot:
+    """Plot the last frames: timings in microseconds and T-states."""
+
+    WINDOW = 300
+
+    def __init__(self):
+        import matplotlib.pyplot as plt
+        self.plt = plt
+        plt.ion()
+        self.fig, (self.ax_time, self.ax_ts) = plt.subplots(2, 1,
+                                                            sharex=True)
+        self.series = {k: [] for k in ['tick', 'z80_us', 'decode_us',
+                                       'display_us', 'frame_us', 'tstates']}
+
+    def add(self, rec):
+        mhz = rec['clock_khz'] / 1000 or 1
+        s = self.series
+        sub = rec['decode_cyc'] + rec['audio_cyc'] + rec['kbd_cyc']
+        s['tick'].append(rec['tick'])
+        s['z80_us'].append(max(rec['exec_us'] - sub / mhz, 0))
+        s['decode_us'].append(rec['decode_cyc'] / mhz)
+        s['display_us'].append((rec['convert_cyc'] + rec['xfer_cyc']) / mhz)
+        s['frame_us'].append(rec['frame_us'])
+        s['tstates'].append(rec['tstates'])
+        for k in s:
+            del s[k][:-self.WINDOW]
+
+    def refresh(self):
+        s = self.series
+        self.ax_time.clear()
+        self.ax_ts.clear()
+        for k in ['z80_us', 'decode_us', 'display_us', 'frame_us']:
+            self.ax_time.plot(s['tick'], s[k], label=k)
+        self.ax_time.legend(loc='upper left')
+        self.ax_ts.plot(s['tick'], s['tstates'], label='tstates')
+        self.ax_ts.legend(loc='upper left')
+        self.plt.pause(0.001)
+
+if __name__ == '__main__':
+    main()
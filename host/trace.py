@@ -0,0 +1,329 @@
+#!/usr/bin/env python3
+#
+# Decode the execution trace printed by the emulator on the USB serial
+# (see the "Execution trace" section of zx.c) and disassemble it against
+# the .z80 image of the game:
+#
+#   ./trace.py capture.txt games/jetpac.z80
+#   cat /dev/ttyACM0 | ./trace.py - games/jetpac.z80
+#
+# The capture may contain any other text printed by the emulator: only
+# the "[trace]" lines are used, and every trace found is decoded. The
+# ROM is read from zx-roms.h (--rom to use a binary image instead).
+#
+# The instructions are disassembled from the memory of the .z80 image,
+# not from the memory at the time of the dump: code the game loads or
+# modifies later is shown as it was in the image. Runs of the same
+# instructions, such as busy loops, are printed once with the number of
+# repetitions.
+
+import os
+import re
+import sys
+
+ROMS_H = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                      '..', 'zx-roms.h')
+MAX_LOOP = 32   # Longest repeated sequence collapsed, in instructions.
+
+# ================================ Memory =================================
+
+def load_rom_h(path):
+    """Return the 48k ROM from the dump_amstrad_zx48k_bin array of
+    zx-roms.h."""
+    with open(path) as f:
+        text = f.read()
+    m = re.search(r'dump_amstrad_zx48k_bin\[\d+\]\s*=\s*\{([^}]*)\}', text)
+    if not m:
+        raise ValueError(f'{path}: 48k ROM not found')
+    return bytes(int(v, 16) for v in m.group(1).split(',') if v.strip())
+
+def unpack_z80(data, length, v1):
+    """Decompress a .z80 memory block (ED ED <count> <byte> runs)."""
+    out = bytearray()
+    pos = 0
+    while pos < length:
+        if v1 and data[pos:pos+4] == b'\x00\xed\xed\x00':
+            break
+        if data[pos:pos+2] == b'\xed\xed':
+            out += bytes([data[pos+3]]) * data[pos+2]
+            pos += 4
+        else:
+            out.append(data[pos])
+            pos += 1
+    return out
+
+def load_z80(path, rom):
+    """Return the 64k memory of the 48k snapshot 'path'."""
+    with open(path, 'rb') as f:
+        data = f.read()
+    mem = bytearray(rom[:0x4000].ljust(0x4000, b'\xff')) + bytearray(0xc000)
+    pc = data[6] | data[7] << 8
+    if pc != 0:
+        # Version 1: one block from 0x4000, compressed if flag bit 5.
+        block = data[30:]
+        if data[12] & 0x20:
+            block = unpack_z80(block, len(block), True)
+        mem[0x4000:0x4000+len(block[:0xc000])] = block[:0xc000]
+        return mem
+    # Versions 2 and 3: 16k pages, 8, 4 and 5 are 0x4000, 0x8000, 0xc000.
+    addr = {8: 0x4000, 4: 0x8000, 5: 0xc000}
+    pos = 32 + (data[30] | data[31] << 8)
+    while pos + 3 <= len(data):
+        length = data[pos] | data[pos+1] << 8
+        page = data[pos+2]
+        pos += 3
+        if length == 0xffff:
+            block = data[pos:pos+0x4000]
+            pos += 0x4000
+        else:
+            block = unpack_z80(data[pos:], length, False)
+            pos += length
+        if page in addr:
+            mem[addr[page]:addr[page]+0x4000] = block[:0x4000].ljust(0x4000, b'\0')
+    return mem
+
+# ============================= Disassembler ==============================
+
+R = ['B', 'C', 'D', 'E', 'H', 'L', '(HL)', 'A']
+RP = ['BC', 'DE', 'HL', 'SP']
+RP2 = ['BC', 'DE', 'HL', 'AF']
+CC = ['NZ', 'Z', 'NC', 'C', 'PO', 'PE', 'P', 'M']
+ALU = ['ADD A,', 'ADC A,', 'SUB ', 'SBC A,', 'AND ', 'XOR ', 'OR ', 'CP ']
+ROT = ['RLC', 'RRC', 'RL', 'RR', 'SLA', 'SRA', 'SLL', 'SRL']
+IM = ['0', '0', '1', '2', '0', '0', '1', '2']
+X0Z7 = ['RLCA', 'RRCA', 'RLA', 'RRA', 'DAA', 'CPL', 'SCF', 'CCF']
+ED_X1Z7 = ['LD I,A', 'LD R,A', 'LD A,I', 'LD A,R', 'RRD', 'RLD', 'NOP*', 'NOP*']
+BLOCK = [['LDI', 'CPI', 'INI', 'OUTI'], ['LDD', 'CPD', 'IND', 'OUTD'],
+         ['LDIR', 'CPIR', 'INIR', 'OTIR'], ['LDDR', 'CPDR', 'INDR', 'OTDR']]
+
+def disasm(mem, pc):
+    """Return the length and the text of the instruction at 'pc'."""
+    n = 0
+    def fetch():
+        nonlocal n
+        n += 1
+        return mem[(pc + n - 1) & 0xffff]
+    def n8():
+        return '$%02X' % fetch()
+    def n16():
+        lo = fetch()
+        return '$%04X' % (lo | fetch() << 8)
+    def rel():
+        d = fetch()
+        return '$%04X' % ((pc + n + (d ^ 0x80) - 0x80) & 0xffff)
+
+    op = fetch()
+    ix = None
+    while op in (0xdd, 0xfd):
+        ix = 'IX' if op == 0xdd else 'IY'
+        op = fetch()
+
+    # With an index prefix (HL) becomes (IX+d), HL becomes IX, and H, L
+    # become IXH, IXL unless the instruction also uses (IX+d).
+    def mem_hl():
+        if not ix:
+            return '(HL)'
+        d = fetch()
+        return '(%s%+d)' % (ix, (d ^ 0x80) - 0x80)
+    def reg(i, indexed=True):
+        if i == 6:
+            return mem_hl()
+        if ix and indexed and i in (4, 5):
+            return ix + 'HL'[i-4]
+        return R[i]
+    def rp(i):
+        return ix if ix and i == 2 else RP[i]
+    def rp2(i):
+        return ix if ix and i == 2 else RP2[i]
+
+    if op == 0xed:
+        op = fetch()
+        x, y, z, p, q = op >> 6, (op >> 3) & 7, op & 7, (op >> 4) & 3, (op >> 3) & 1
+        if x == 1:
+            if z == 0:
+                text = 'IN (C)' if y == 6 else f'IN {R[y]},(C)'
+            elif z == 1:
+                text = 'OUT (C),0' if y == 6 else f'OUT (C),{R[y]}'
+            elif z == 2:
+                text = f'{"ADC" if q else "SBC"} HL,{RP[p]}'
+            elif z == 3:
+                text = f'LD {RP[p]},({n16()})' if q else f'LD ({n16()}),{RP[p]}'
+            elif z == 4:
+                text = 'NEG'
+            elif z == 5:
+                text = 'RETI' if y == 1 else 'RETN'
+            elif z == 6:
+                text = f'IM {IM[y]}'
+            else:
+                text = ED_X1Z7[y]
+        elif x == 2 and z <= 3 and y >= 4:
+            text = BLOCK[y-4][z]
+        else:
+            text = 'NOP*'
+        return n, text
+
+    if op == 0xcb:
+        if ix:
+            # DD CB d op: the displacement comes before the opcode.
+            operand = mem_hl()
+            op = fetch()
+            z = op & 7
+            if z != 6 and op >> 6 != 1:
+                operand += ',' + R[z]   # Undocumented copy to a register.
+        else:
+            op = fetch()
+            z = op & 7
+            operand = R[z]
+        x, y = op >> 6, (op >> 3) & 7
+        if x == 0:
+            return n, f'{ROT[y]} {operand}'
+        return n, f'{["", "BIT", "RES", "SET"][x]} {y},{operand}'
+
+    x, y, z, p, q = op >> 6, (op >> 3) & 7, op & 7, (op >> 4) & 3, (op >> 3) & 1
+    hl = rp(2)
+    if x == 0:
+        if z == 0:
+            if y == 0: text = 'NOP'
+            elif y == 1: text = "EX AF,AF'"
+            elif y == 2: text = f'DJNZ {rel()}'
+            elif y == 3: text = f'JR {rel()}'
+            else: text = f'JR {CC[y-4]},{rel()}'
+        elif z == 1:
+            text = f'ADD {hl},{rp(p)}' if q else f'LD {rp(p)},{n16()}'
+        elif z == 2:
+            if p < 2:
+                ptr = '(BC)' if p == 0 else '(DE)'
+                text = f'LD A,{ptr}' if q else f'LD {ptr},A'
+            else:
+                r = hl if p == 2 else 'A'
+                ptr = f'({n16()})'
+                text = f'LD {r},{ptr}' if q else f'LD {ptr},{r}'
+        elif z == 3:
+            text = f'{"DEC" if q else "INC"} {rp(p)}'
+        elif z == 4:
+            text = f'INC {reg(y)}'
+        elif z == 5:
+            text = f'DEC {reg(y)}'
+        elif z == 6:
+            text = f'LD {reg(y)},{n8()}'
+        else:
+            text = X0Z7[y]
+    elif x == 1:
+        if y == 6 and z == 6:
+            text = 'HALT'
+        else:
+            indexed = y != 6 and z != 6
+            text = f'LD {reg(y, indexed)},{reg(z, indexed)}'
+    elif x == 2:
+        text = ALU[y] + reg(z)
+    else:
+        if z == 0:
+            text = f'RET {CC[y]}'
+        elif z == 1:
+            text = f'POP {rp2(p)}' if not q else \
+                   ['RET', 'EXX', f'JP ({hl})', f'LD SP,{hl}'][p]
+        elif z == 2:
+            text = f'JP {CC[y]},{n16()}'
+        elif z == 3:
+            if y == 0: text = f'JP {n16()}'
+            elif y == 2: text = f'OUT ({n8()}),A'
+            elif y == 3: text = f'IN A,({n8()})'
+            else: text = ['', '', '', '', f'EX (SP),{hl}', 'EX DE,HL',
+                          'DI', 'EI'][y]
+        elif z == 4:
+            text = f'CALL {CC[y]},{n16()}'
+        elif z == 5:
+            text = f'PUSH {rp2(p)}' if not q else f'CALL {n16()}'
+        elif z == 6:
+            text = ALU[y] + n8()
+        else:
+            text = f'RST ${y*8:02X}'
+    return n, text
+
+# ================================ Traces =================================
+
+def parse_traces(lines):
+    """Return the list of (game, entries) of the traces in 'lines'. Each
+    entry is (kind, addr), kind '' for instructions, 'i' or 'n' for
+    interrupts."""
+    traces = []
+    current = None
+    for line in lines:
+        if '[trace]' not in line:
+            continue
+        fields = line.split('[trace]', 1)[1].split()
+        if fields[:1] == ['begin']:
+            current = (fields[1] if len(fields) > 1 else '-', [])
+        elif fields[:1] == ['end']:
+            if current:
+                traces.append(current)
+            current = None
+        elif current:
+            for f in fields:
+                kind = f[0] if f[0] in 'in' else ''
+                current[1].append((kind, int(f[len(kind):], 16)))
+    return traces
+
+def find_loop(entries, i):
+    """Return (period, count) of the longest run of a repeated sequence
+    starting at 'i', or (1, 1) if there is none."""
+    best = (1, 1)
+    for period in range(1, MAX_LOOP+1):
+        count = 1
+        while entries[i:i+period] == \
+              entries[i+count*period:i+(count+1)*period]:
+            count += 1
+        if count > 1 and period*count > best[0]*best[1]:
+            best = (period, count)
+    return best
+
+def print_entry(mem, kind, addr, indent=''):
+    if kind:
+        what = 'NMI' if kind == 'n' else 'interrupt'
+        print(f'{indent}--- {what}, return address {addr:04x}')
+        return
+    length, text = disasm(mem, addr)
+    code = ' '.join('%02x' % mem[(addr+j) & 0xffff] for j in range(length))
+    print(f'{indent}{addr:04x}  {code:12} {text}')
+
+def print_trace(mem, game, entries):
+    print(f'=== {game}: {len(entries)} entries, oldest first')
+    i = 0
+    while i < len(entries):
+        period, count = find_loop(entries, i)
+        if count > 2:
+            print(f'[{count} times]')
+            for kind, addr in entries[i:i+period]:
+                print_entry(mem, kind, addr, '    ')
+            i += period*count
+        else:
+            print_entry(mem, *entries[i])
+            i += 1
+
+if __name__ == '__main__':
+    args = sys.argv[1:]
+    rom_path = None
+    if '--rom' in args:
+        j = args.index('--rom')
+        rom_path = args[j+1] if j+1 < len(args) else ''
+        del args[j:j+2]
+    if len(args) != 2 or rom_path == '':
+        print(f'Usage: {sys.argv[0]} <capture|-> <game.z80> [--rom <48k.rom>]')
+        sys.exit(1)
+    if rom_path:
+        with open(rom_path, 'rb') as f:
+            rom = f.read()
+    else:
+        rom = load_rom_h(ROMS_H)
+    mem = load_z80(args[1], rom)
+    if args[0] == '-':
+        lines = sys.stdin.readlines()
+    else:
+        with open(args[0], errors='replace') as f:
+            lines = f.readlines()
+    traces = parse_traces(lines)
+    if not traces:
+        print('No trace found.')
+        sys.exit(1)
+    for game, entries in traces:
+        print_trace(mem, game, entries)
@@ -0,0 +1,363 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info. */
+
+/* Differential tester: run the same program on the z80.h of this
+ * emulator, that was modified for speed, and on the unmodified upstream
+ * one (see z80ref.c), one instruction at a time, comparing the results.
+ *
+ *   z80diff games/jetpac.z80 --steps 1000000
+ *   z80diff --bin test.bin --org 0x8000
+ *
+ * Differences are classified as:
+ *
+ * - functional: registers, documented flags, memory and port writes.
+ *   The first one stops the test, since it is a bug.
+ * - undocumented: the X/Y flags and the internal WZ register.
+ * - timing: ticks per instruction and the R register, that the modified
+ *   core is expected to get wrong.
+ *
+ * After a non functional difference the reference state is copied into
+ * the tested core (unless --no-resync), so that, for instance, a game
+ * using R as random seed does not diverge later for that reason alone.
+ * Finally both cores run the same instruction stream alone, to report
+ * the speedup. */
+
+#include "zxhost.h"
+#include "z80ref.h"
+
+#define FLAGS_UNDOC (Z80_XF|Z80_YF)
+
+/* ============================ The tested core ============================= */
+
+typedef struct {
+    z80_t cpu;
+    mem_t mem;
+    uint64_t pins;
+    uint8_t *ram;
+} z80local_t;
+
+static uint64_t local_bus(z80local_t *l, uint64_t pins, z80diff_bus_t *bus) {
+    const uint16_t addr = Z80_GET_ADDR(pins);
+    if (pins & Z80_MREQ) {
+        if (pins & Z80_RD) {
+            Z80_SET_DATA(pins, mem_rd(&l->mem, addr));
+        } else if (pins & Z80_WR) {
+            if (bus->count < Z80DIFF_MAX_WRITES) {
+                bus->w[bus->count].addr = addr;
+                bus->w[bus->count].data = Z80_GET_DATA(pins);
+                bus->w[bus->count++].io = 0;
+            }
+            mem_wr(&l->mem, addr, Z80_GET_DATA(pins));
+        }
+    } else if (pins & Z80_IORQ) {
+        if (pins & (Z80_M1|Z80_RD)) {
+            Z80_SET_DATA(pins, 0xff);
+        } else if ((pins & Z80_WR) && bus->count < Z80DIFF_MAX_WRITES) {
+            bus->w[bus->count].addr = addr;
+            bus->w[bus->count].data = Z80_GET_DATA(pins);
+            bus->w[bus->count++].io = 1;
+        }
+    }
+    return pins;
+}
+
+static int local_step(z80local_t *l, int irq, z80diff_bus_t *bus) {
+    uint32_t ticks = 0;
+    bus->count = 0;
+    do {
+        if (irq) l->pins |= Z80_INT; else l->pins &= ~Z80_INT;
+        l->pins = z80_tick(&l->cpu, &l->mem, l->pins);
+        l->pins = local_bus(l, l->pins, bus);
+        if (++ticks == Z80DIFF_MAX_TICKS) return -1;
+    } while (!z80_opdone(&l->cpu));
+    bus->ticks = ticks;
+    return 0;
+}
+
+static void local_init(z80local_t *l, uint8_t *ram) {
+    memset(l,0,sizeof(*l));
+    l->ram = ram;
+    mem_init(&l->mem);
+    mem_map_rom(&l->mem, 0, 0x0000, Z80DIFF_ROM_SIZE, ram);
+    mem_map_ram(&l->mem, 0, Z80DIFF_ROM_SIZE, 0x10000-Z80DIFF_ROM_SIZE,
+                ram+Z80DIFF_ROM_SIZE);
+}
+
+static void local_set_regs(z80local_t *l, const z80diff_regs_t *r) {
+    z80_t *c = &l->cpu;
+    c->af = r->af; c->bc = r->bc; c->de = r->de; c->hl = r->hl;
+    c->ix = r->ix; c->iy = r->iy; c->sp = r->sp; c->wz = r->wz;
+    c->af2 = r->af2; c->bc2 = r->bc2; c->de2 = r->de2; c->hl2 = r->hl2;
+    c->i = r->i; c->r = r->r; c->im = r->im;
+    c->iff1 = r->iff1; c->iff2 = r->iff2;
+}
+
+static void local_start(z80local_t *l, const z80diff_regs_t *r) {
+    z80diff_bus_t bus;
+    z80_reset(&l->cpu);
+    local_set_regs(l,r);
+    l->pins = z80_prefetch(&l->cpu, r->pc);
+    local_step(l,0,&bus);   // Fetch the first opcode.
+}
+
+static void cpu_regs(z80_t *c, z80diff_regs_t *r) {
+    r->af = c->af; r->bc = c->bc; r->de = c->de; r->hl = c->hl;
+    r->ix = c->ix; r->iy = c->iy; r->sp = c->sp; r->pc = c->pc;
+    r->wz = c->wz;
+    r->af2 = c->af2; r->bc2 = c->bc2; r->de2 = c->de2; r->hl2 = c->hl2;
+    r->i = c->i; r->r = c->r; r->im = c->im;
+    r->iff1 = c->iff1; r->iff2 = c->iff2;
+}
+
+static void local_regs(z80local_t *l, z80diff_regs_t *r) {
+    cpu_regs(&l->cpu,r);
+}
+
+/* ============================== Comparison ================================ */
+
+#define DIFF_NONE 0
+#define DIFF_TIMING 1
+#define DIFF_UNDOC 2
+#define DIFF_FUNCTIONAL 3
+
+static int diff_regs(const z80diff_regs_t *a, const z80diff_regs_t *b) {
+    if ((a->af & ~FLAGS_UNDOC) != (b->af & ~FLAGS_UNDOC) ||
+        a->bc != b->bc || a->de != b->de || a->hl != b->hl ||
+        a->ix != b->ix || a->iy != b->iy || a->sp != b->sp ||
+        a->pc != b->pc || a->af2 != b->af2 || a->bc2 != b->bc2 ||
+        a->de2 != b->de2 || a->hl2 != b->hl2 || a->i != b->i ||
+        a->im != b->im || a->iff1 != b->iff1 || a->iff2 != b->iff2)
+        return DIFF_FUNCTIONAL;
+    if (a->af != b->af || a->wz != b->wz) return DIFF_UNDOC;
+    if (a->r != b->r) return DIFF_TIMING;
+    return DIFF_NONE;
+}
+
+static int diff_bus(const z80diff_bus_t *a, const z80diff_bus_t *b) {
+    if (a->count != b->count ||
+        memcmp(a->w,b->w,sizeof(a->w[0])*a->count))
+        return DIFF_FUNCTIONAL;
+    if (a->ticks != b->ticks) return DIFF_TIMING;
+    return DIFF_NONE;
+}
+
+static void print_regs(const char *name, const z80diff_regs_t *r) {
+    printf("  %-9s AF=%04x BC=%04x DE=%04x HL=%04x IX=%04x IY=%04x "
+           "SP=%04x PC=%04x WZ=%04x\n"
+           "            AF'=%04x BC'=%04x DE'=%04x HL'=%04x "
+           "I=%02x R=%02x IM=%d IFF=%d%d\n",
+        name, r->af, r->bc, r->de, r->hl, r->ix, r->iy, r->sp, r->pc,
+        r->wz, r->af2, r->bc2, r->de2, r->hl2, r->i, r->r, r->im,
+        r->iff1, r->iff2);
+}
+
+static void print_bus(const char *name, const z80diff_bus_t *b) {
+    printf("  %-9s %u ticks, writes:", name, b->ticks);
+    for (uint32_t j = 0; j < b->count; j++)
+        printf(" %s%04x=%02x", b->w[j].io ? "port " : "",
+            b->w[j].addr, b->w[j].data);
+    printf("\n");
+}
+
+// Per opcode counters of the non functional differences. Opcodes are
+// identified by the first two bytes, so that prefixes are told apart.
+static uint32_t TimingDiffs[0x10000];
+static int32_t TimingDelta[0x10000];    // Sum of tick differences.
+static uint32_t UndocDiffs[0x10000];
+
+static uint16_t opcode_key(const uint8_t *mem, uint16_t pc) {
+    uint8_t op = mem[pc];
+    if (op == 0xcb || op == 0xdd || op == 0xed || op == 0xfd)
+        return (op<<8) | mem[(uint16_t)(pc+1)];
+    return op;
+}
+
+static void print_top(const char *title, uint32_t *counts, int with_delta) {
+    printf("%s:\n", title);
+    for (int n = 0; n < 10; n++) {
+        uint32_t best = 0;
+        for (uint32_t j = 1; j < 0x10000; j++)
+            if (counts[j] > counts[best]) best = j;
+        if (counts[best] == 0) break;
+        printf("  %s%04x: %u times", best > 0xff ? "" : "  ", best,
+            counts[best]);
+        if (with_delta)
+            printf(", %+.1f ticks on average",
+                (double)TimingDelta[best]/counts[best]);
+        printf("\n");
+        counts[best] = 0;
+    }
+}
+
+/* ================================= Main =================================== */
+
+static void usage(const char *progname) {
+    fprintf(stderr,
+"Usage: %s [options] <game.z80>\n"
+"       %s [options] --bin <file> --org <addr>\n"
+"  --steps <count>      Instructions to execute (default 1000000).\n"
+"  --irq-ticks <ticks>  Raise INT every <ticks> (default 69888, 0 = never).\n"
+"  --no-resync          Don't copy non functional state after differences.\n",
+    progname, progname);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *game = NULL, *bin = NULL;
+    uint32_t org = 0, steps = 1000000, irq_ticks = 69888;
+    int resync = 1;
+
+    for (int j = 1; j < argc; j++) {
+        int moreargs = j+1 < argc;
+        if (!strcmp(argv[j],"--steps") && moreargs) {
+            steps = strtoul(argv[++j],NULL,0);
+        } else if (!strcmp(argv[j],"--irq-ticks") && moreargs) {
+            irq_ticks = strtoul(argv[++j],NULL,0);
+        } else if (!strcmp(argv[j],"--bin") && moreargs) {
+            bin = argv[++j];
+        } else if (!strcmp(argv[j],"--org") && moreargs) {
+            org = strtoul(argv[++j],NULL,0);
+        } else if (!strcmp(argv[j],"--no-resync")) {
+            resync = 0;
+        } else if (argv[j][0] != '-' && game == NULL) {
+            game = argv[j];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if ((game == NULL) == (bin == NULL) || org > 0xffff) usage(argv[0]);
+
+    // Build the initial memory image and registers.
+    static uint8_t image[0x10000];
+    z80diff_regs_t start = {
+        .af = 0xffff, .bc = 0xffff, .de = 0xffff, .hl = 0xffff,
+        .ix = 0xffff, .iy = 0xffff, .sp = 0xffff, .wz = 0xffff,
+        .af2 = 0xffff, .bc2 = 0xffff, .de2 = 0xffff, .hl2 = 0xffff,
+        .pc = org
+    };
+    if (game) {
+        static zx_t zx;
+        if (zxhost_load_game(&zx,game) == -1) exit(1);
+        for (uint32_t addr = 0; addr < 0x10000; addr++)
+            image[addr] = mem_rd(&zx.mem,addr);
+        // The loader left the CPU at an instruction boundary.
+        cpu_regs(&zx.cpu,&start);
+    } else {
+        size_t len;
+        uint8_t *data = zxhost_read_file(bin,&len);
+        if (!data) {
+            perror(bin);
+            exit(1);
+        }
+        if (len > 0x10000-org) len = 0x10000-org;
+        memcpy(image+org,data,len);
+        free(data);
+    }
+
+    static uint8_t local_mem[0x10000], ref_mem[0x10000];
+    memcpy(local_mem,image,sizeof(image));
+    memcpy(ref_mem,image,sizeof(image));
+    static z80local_t local;
+    local_init(&local,local_mem);
+    local_start(&local,&start);
+    z80ref_t *ref = z80ref_new(ref_mem);
+    z80ref_start(ref,&start);
+
+    // Lockstep comparison.
+    uint64_t ref_ticks = 0, local_ticks = 0, next_irq = irq_ticks;
+    uint32_t timing = 0, undoc = 0;
+    for (uint32_t step = 0; step < steps; step++) {
+        z80diff_regs_t lr, rr;
+        z80diff_bus_t lb, rb;
+        z80ref_regs(ref,&rr);
+        uint16_t pc = rr.pc-1; // PC was already incremented by the fetch.
+        uint16_t key = opcode_key(ref_mem,pc);
+
+        // The INT pin is driven by the reference core time for both,
+        // held for the whole instruction after the frame boundary.
+        int irq = irq_ticks && ref_ticks >= next_irq;
+        if (irq) next_irq += irq_ticks;
+        int lerr = local_step(&local,irq,&lb);
+        int rerr = z80ref_step(ref,irq,&rb);
+        local_ticks += lb.ticks;
+        ref_ticks += rb.ticks;
+        local_regs(&local,&lr);
+        z80ref_regs(ref,&rr);
+
+        int d = diff_regs(&lr,&rr), bd = diff_bus(&lb,&rb);
+        if (bd > d) d = bd;
+        if (lerr || rerr ||
+            (step % 1000 == 0 && memcmp(local_mem,ref_mem,0x10000)))
+            d = DIFF_FUNCTIONAL;
+        if (d == DIFF_FUNCTIONAL) {
+            printf("Functional difference at instruction %u, "
+                   "PC=%04x opcode %02x %02x %02x %02x%s\n",
+                step, pc, ref_mem[pc], ref_mem[(uint16_t)(pc+1)],
+                ref_mem[(uint16_t)(pc+2)], ref_mem[(uint16_t)(pc+3)],
+                lerr || rerr ? " (CPU stuck)" : "");
+            print_regs("modified",&lr);
+            print_regs("upstream",&rr);
+            print_bus("modified",&lb);
+            print_bus("upstream",&rb);
+            for (uint32_t addr = 0; addr < 0x10000; addr++) {
+                if (local_mem[addr] == ref_mem[addr]) continue;
+                printf("  memory differs at %04x: %02x vs %02x\n",
+                    addr, local_mem[addr], ref_mem[addr]);
+                break;
+            }
+            exit(1);
+        }
+        if (lb.ticks != rb.ticks || lr.r != rr.r) {
+            timing++;
+            TimingDiffs[key]++;
+            TimingDelta[key] += (int32_t)lb.ticks-(int32_t)rb.ticks;
+        }
+        if (d == DIFF_UNDOC) {
+            undoc++;
+            UndocDiffs[key]++;
+        }
+        if (d != DIFF_NONE && resync) {
+            local.cpu.f = rr.af & 0xff;
+            local.cpu.wz = rr.wz;
+            local.cpu.r = rr.r;
+        }
+    }
+
+    printf("%u instructions, no functional differences.\n"
+           "Ticks: %llu modified, %llu upstream.\n"
+           "Instructions with timing differences: %u\n"
+           "Instructions with undocumented state differences: %u\n",
+        steps, (unsigned long long)local_ticks,
+        (unsigned long long)ref_ticks, timing, undoc);
+    print_top("Top timing differences by opcode",TimingDiffs,1);
+    print_top("Top undocumented differences by opcode",UndocDiffs,0);
+
+    // Speed: each core alone over the same instruction stream. Interrupts
+    // are raised at the same instructions for both.
+    z80diff_bus_t bus;
+    uint8_t *irq_at = calloc(steps/8+1,1);
+    memcpy(local_mem,image,sizeof(image));
+    memcpy(ref_mem,image,sizeof(image));
+    local_start(&local,&start);
+    z80ref_start(ref,&start);
+    uint64_t t0 = get_absolute_time(), ticks = 0;
+    next_irq = irq_ticks;
+    for (uint32_t step = 0; step < steps; step++) {
+        int irq = irq_ticks && ticks >= next_irq;
+        if (irq) {
+            next_irq += irq_ticks;
+            irq_at[step/8] |= 1<<(step&7);
+        }
+        z80ref_step(ref,irq,&bus);
+        ticks += bus.ticks;
+    }
+    uint64_t t1 = get_absolute_time();
+    for (uint32_t step = 0; step < steps; step++)
+        local_step(&local,irq_at[step/8] & (1<<(step&7)),&bus);
+    uint64_t t2 = get_absolute_time();
+    printf("Speed: upstream %llu us, modified %llu us, speedup %.2fx\n",
+        (unsigned long long)(t1-t0), (unsigned long long)(t2-t1),
+        t2 > t1 ? (double)(t1-t0)/(t2-t1) : 0);
+    return 0;
+}
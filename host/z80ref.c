@@ -0,0 +1,100 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info. */
+
+/* The upstream z80.h (see fetch-reference.sh), wrapped behind the
+ * interface of z80ref.h. Z80_REFERENCE is set by CMake to the path of
+ * the upstream header. */
+
+#include <stdlib.h>
+#include <stdbool.h>
+
+#define z80_init z80ref_cpu_init
+#define z80_reset z80ref_cpu_reset
+#define z80_tick z80ref_cpu_tick
+#define z80_prefetch z80ref_cpu_prefetch
+#define z80_opdone z80ref_cpu_opdone
+#define CHIPS_IMPL
+#include Z80_REFERENCE
+
+#include "z80ref.h"
+
+struct z80ref {
+    z80_t cpu;
+    uint64_t pins;
+    uint8_t *mem;
+};
+
+z80ref_t *z80ref_new(uint8_t *mem) {
+    z80ref_t *ref = calloc(1,sizeof(*ref));
+    ref->mem = mem;
+    z80_init(&ref->cpu);
+    return ref;
+}
+
+// Serve the memory or I/O request in 'pins', logging writes into 'bus'.
+static uint64_t z80ref_bus(z80ref_t *ref, uint64_t pins, z80diff_bus_t *bus) {
+    const uint16_t addr = Z80_GET_ADDR(pins);
+    if (pins & Z80_MREQ) {
+        if (pins & Z80_RD) {
+            Z80_SET_DATA(pins, ref->mem[addr]);
+        } else if (pins & Z80_WR) {
+            if (bus && bus->count < Z80DIFF_MAX_WRITES) {
+                bus->w[bus->count].addr = addr;
+                bus->w[bus->count].data = Z80_GET_DATA(pins);
+                bus->w[bus->count++].io = 0;
+            }
+            if (addr >= Z80DIFF_ROM_SIZE) ref->mem[addr] = Z80_GET_DATA(pins);
+        }
+    } else if (pins & Z80_IORQ) {
+        // Interrupt acknowledge (M1|IORQ) and port reads see 0xff.
+        if (pins & (Z80_M1|Z80_RD)) {
+            Z80_SET_DATA(pins, 0xff);
+        } else if ((pins & Z80_WR) && bus && bus->count < Z80DIFF_MAX_WRITES) {
+            bus->w[bus->count].addr = addr;
+            bus->w[bus->count].data = Z80_GET_DATA(pins);
+            bus->w[bus->count++].io = 1;
+        }
+    }
+    return pins;
+}
+
+// Tick until the next instruction boundary.
+static int z80ref_run(z80ref_t *ref, int irq, z80diff_bus_t *bus) {
+    uint32_t ticks = 0;
+    do {
+        if (irq) ref->pins |= Z80_INT; else ref->pins &= ~Z80_INT;
+        ref->pins = z80_tick(&ref->cpu, ref->pins);
+        ref->pins = z80ref_bus(ref, ref->pins, bus);
+        if (++ticks == Z80DIFF_MAX_TICKS) return -1;
+    } while (!z80_opdone(&ref->cpu));
+    if (bus) bus->ticks = ticks;
+    return 0;
+}
+
+void z80ref_start(z80ref_t *ref, const z80diff_regs_t *r) {
+    z80_t *c = &ref->cpu;
+    z80_reset(c);
+    c->af = r->af; c->bc = r->bc; c->de = r->de; c->hl = r->hl;
+    c->ix = r->ix; c->iy = r->iy; c->sp = r->sp; c->wz = r->wz;
+    c->af2 = r->af2; c->bc2 = r->bc2; c->de2 = r->de2; c->hl2 = r->hl2;
+    c->i = r->i; c->r = r->r; c->im = r->im;
+    c->iff1 = r->iff1; c->iff2 = r->iff2;
+    ref->pins = z80_prefetch(c, r->pc);
+    z80ref_run(ref, 0, NULL);   // Fetch the first opcode.
+}
+
+int z80ref_step(z80ref_t *ref, int irq, z80diff_bus_t *bus) {
+    bus->count = 0;
+    return z80ref_run(ref, irq, bus);
+}
+
+void z80ref_regs(z80ref_t *ref, z80diff_regs_t *r) {
+    z80_t *c = &ref->cpu;
+    r->af = c->af; r->bc = c->bc; r->de = c->de; r->hl = c->hl;
+    r->ix = c->ix; r->iy = c->iy; r->sp = c->sp; r->pc = c->pc;
+    r->wz = c->wz;
+    r->af2 = c->af2; r->bc2 = c->bc2; r->de2 = c->de2; r->hl2 = c->hl2;
+    r->i = c->i; r->r = c->r; r->im = c->im;
+    r->iff1 = c->iff1; r->iff2 = c->iff2;
+}
@@ -0,0 +1,45 @@
+/* Interface between the differential tester (z80diff.c) and the
+ * unmodified upstream z80.h. The two cores have the same names, so
+ * the upstream one is compiled alone in z80ref.c, with its public
+ * functions renamed, and only seen by the tester through this file. */
+
+#pragma once
+#include <stdint.h>
+
+// Register set, as seen at instruction boundaries.
+typedef struct {
+    uint16_t af, bc, de, hl, ix, iy, sp, pc, wz;
+    uint16_t af2, bc2, de2, hl2;
+    uint8_t i, r, im, iff1, iff2;
+} z80diff_regs_t;
+
+// Bus writes performed by a single instruction, and its length in ticks.
+#define Z80DIFF_MAX_WRITES 64
+typedef struct {
+    uint32_t ticks;
+    uint32_t count;
+    struct {
+        uint16_t addr;
+        uint8_t data;
+        uint8_t io;         // 1 for I/O port writes, 0 for memory.
+    } w[Z80DIFF_MAX_WRITES];
+} z80diff_bus_t;
+
+// Max ticks of an instruction before we give up (the CPU is stuck).
+#define Z80DIFF_MAX_TICKS 100000
+
+// Memory model shared by both sides: 64k flat, the first 16k read only
+// like the Spectrum ROM. I/O reads return 0xff.
+#define Z80DIFF_ROM_SIZE 0x4000
+
+typedef struct z80ref z80ref_t;
+
+// Create a reference CPU working on the 64k memory 'mem'.
+z80ref_t *z80ref_new(uint8_t *mem);
+// Load the registers and start executing at regs->pc.
+void z80ref_start(z80ref_t *ref, const z80diff_regs_t *regs);
+// Execute one instruction, with the INT pin held active if 'irq'.
+// Returns 0 on success, -1 if the instruction did not complete.
+int z80ref_step(z80ref_t *ref, int irq, z80diff_bus_t *bus);
+// Get the current registers.
+void z80ref_regs(z80ref_t *ref, z80diff_regs_t *regs);
@@ -0,0 +1,165 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info. */
+
+/* Batch runner: run many games, or the same game with different input
+ * movies, concurrently on a pool of threads, each with its own emulator
+ * instance. Useful to run regressions over the whole catalog quickly.
+ *
+ *   zxbatch -j 8 --frames 1000 games/NAME.z80 games/jetpac.z80:movie.bin
+ *
+ * A job is a game, optionally followed by ':' and a binary keymap with
+ * the input to use (see games/kmap.py), otherwise the builtin keymap of
+ * the game is used, like in zxrun. For each run the final framebuffer
+ * hash and the speed are reported, then the aggregate throughput.
+ * With --repeat every job is executed multiple times, and the runs of
+ * the same job must produce the same hash.
+ *
+ * Note: the core has no global state other than the mem.h dummy pages,
+ * that are shared but only hold junk writes and constant 0xff bytes.
+ * The device front-end in zx.c is not instance-safe instead (see EMU),
+ * so it can't be used here. */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "zxhost.h"
+
+struct job {
+    char game[512];         // Game path.
+    const char *keys;       // Input movie path, or NULL.
+    uint64_t ticks;         // Emulated T-states.
+    uint64_t us;            // Run time in microseconds.
+    uint64_t hash;          // Framebuffer hash after the last frame.
+    int err;                // True if the game or input can't be loaded.
+};
+
+static struct {
+    struct job *jobs;
+    int count;
+    int next;               // Next job to execute.
+    uint32_t frames;
+    pthread_mutex_t lock;
+} Batch = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Worker thread: take jobs from the queue until there are no more.
+static void *batch_worker(void *arg) {
+    (void)arg;
+    zx_t *zx = malloc(sizeof(*zx));
+    kmap_timeline_t input;
+
+    while (1) {
+        pthread_mutex_lock(&Batch.lock);
+        int id = Batch.next < Batch.count ? Batch.next++ : -1;
+        pthread_mutex_unlock(&Batch.lock);
+        if (id == -1) break;
+
+        struct job *j = Batch.jobs+id;
+        if (zxhost_load_game(zx,j->game) == -1 ||
+            zxhost_load_input(&input,j->game,j->keys,NULL) == -1)
+        {
+            j->err = 1;
+            continue;
+        }
+        absolute_time_t start = get_absolute_time();
+        for (uint32_t frame = 0; frame < Batch.frames; frame++) {
+            kmap_timeline_run(&input,zx,frame);
+            j->ticks += zx_exec(zx,ZXHOST_FRAME_USEC);
+        }
+        j->us = get_absolute_time()-start;
+        j->hash = zxhost_fb_hash(zx);
+    }
+    free(zx);
+    return NULL;
+}
+
+static void usage(const char *progname) {
+    fprintf(stderr,
+"Usage: %s [options] <game.z80[:input.bin]> ...\n"
+"  -j <threads>         Threads to use (default: number of CPUs).\n"
+"  --frames <count>     Frames to run for each job (default 500).\n"
+"  --repeat <count>     Run every job <count> times (default 1).\n"
+"  --csv                CSV output.\n",
+    progname);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int repeat = 1, csv = 0;
+    Batch.frames = 500;
+
+    // Parse the options first: we need --repeat to create the jobs.
+    const char **spec = malloc(sizeof(char*)*argc);
+    int specs = 0;
+    for (int j = 1; j < argc; j++) {
+        int moreargs = j+1 < argc;
+        if (!strcmp(argv[j],"-j") && moreargs) {
+            threads = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--frames") && moreargs) {
+            Batch.frames = strtoul(argv[++j],NULL,0);
+        } else if (!strcmp(argv[j],"--repeat") && moreargs) {
+            repeat = atoi(argv[++j]);
+        } else if (!strcmp(argv[j],"--csv")) {
+            csv = 1;
+        } else if (argv[j][0] != '-') {
+            spec[specs++] = argv[j];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (specs == 0 || threads <= 0 || repeat <= 0) usage(argv[0]);
+
+    // Create the jobs: each spec, 'repeat' times.
+    Batch.count = specs*repeat;
+    Batch.jobs = calloc(Batch.count,sizeof(struct job));
+    for (int j = 0; j < Batch.count; j++) {
+        struct job *job = Batch.jobs+j;
+        snprintf(job->game,sizeof(job->game),"%s",spec[j%specs]);
+        char *colon = strchr(job->game,':');
+        if (colon) {
+            *colon = 0;
+            job->keys = colon+1;
+        }
+    }
+    if (threads > Batch.count) threads = Batch.count;
+
+    absolute_time_t start = get_absolute_time();
+    pthread_t *tid = malloc(sizeof(pthread_t)*threads);
+    for (int j = 0; j < threads; j++)
+        pthread_create(tid+j,NULL,batch_worker,NULL);
+    for (int j = 0; j < threads; j++)
+        pthread_join(tid[j],NULL);
+    uint64_t wall_us = get_absolute_time()-start;
+
+    // Per run results. Runs of the same spec must match the first one.
+    int failed = 0;
+    uint64_t ticks = 0, run_us = 0;
+    if (csv) printf("game,input,run,tstates,seconds,mhz,hash,status\n");
+    for (int j = 0; j < Batch.count; j++) {
+        struct job *job = Batch.jobs+j, *first = Batch.jobs+j%specs;
+        const char *status = "ok";
+        if (job->err) status = "error";
+        else if (job->hash != first->hash) status = "mismatch";
+        if (strcmp(status,"ok")) failed = 1;
+        ticks += job->ticks;
+        run_us += job->us;
+
+        double secs = job->us/1e6;
+        printf(csv ? "%s,%s,%d,%llu,%.6f,%.2f,%016llx,%s\n" :
+                     "%-24s %-16s run %-3d %12llu T-states %8.3f s "
+                     "%8.2f MHz %016llx %s\n",
+            job->game, job->keys ? job->keys : "-", j/specs,
+            (unsigned long long)job->ticks, secs,
+            secs ? job->ticks/secs/1e6 : 0,
+            (unsigned long long)job->hash, status);
+    }
+
+    double wall = wall_us/1e6;
+    fprintf(stderr,
+        "%d runs on %d threads in %.3f s: %.2f MHz aggregate, "
+        "%.1f frames/s, %.2fx speedup over serial execution\n",
+        Batch.count, threads, wall, ticks/wall/1e6,
+        (double)Batch.count*Batch.frames/wall, (double)run_us/wall_us);
+    return failed;
+}
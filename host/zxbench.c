@@ -0,0 +1,323 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info. */
+
+/* Benchmark suite: run every game given on the command line for a fixed
+ * number of frames, with the key macros of its builtin keymap as input,
+ * and report speed and time per subsystem as JSON or CSV.
+ *
+ * Each game is run twice: the first run, with the profiling hooks
+ * disabled, measures the speed; the second one measures the time spent
+ * in video decoding, audio sampling and keyboard handling (the rest is
+ * the Z80 emulation). The hooks run thousands of times per frame: their
+ * cost, measured at startup by zxprof_calibrate(), is subtracted from
+ * the subsystems and reported as "hooks". What is left of the slowdown
+ * of the profiled run (cache and pipeline effects of the hooks) is
+ * reported as "distortion_pct": the subsystem split is only as precise
+ * as that. The framebuffer hash is recorded at fixed
+ * checkpoints, and must be the same in both runs and match the golden
+ * file if given, so that an optimization that changes the emulation
+ * output is caught in the same run that measures it.
+ *
+ *   zxbench --golden golden.txt games/NAME.z80 ...
+ *
+ * The exit code is 1 if any hash does not match, or, with a golden file,
+ * if any checkpoint is missing from it. */
+
+#include "zxhost.h"
+
+#define MAX_CHECKPOINTS 64
+
+struct bench_result {
+    const char *game;           // Game path.
+    char name[64];              // Game name, used in the golden file.
+    uint64_t ticks;             // Emulated T-states.
+    uint64_t ns;                // Wall time of the non profiled run.
+    uint64_t prof_ns;           // Wall time of the profiled run.
+    uint64_t sub_ns[ZX_PROF_COUNT]; // Profiled time per subsystem.
+    uint64_t hooks_ns;          // Cost of the profiling hooks.
+    uint64_t input_ns;          // Profiled time running the key macros.
+    uint32_t checkpoints;
+    uint32_t cp_frame[MAX_CHECKPOINTS];
+    uint64_t cp_hash[MAX_CHECKPOINTS];
+    const char *status;         // "ok", "mismatch", "nondeterministic", ...
+};
+
+/* ============================== Golden file ===============================
+ * One line per checkpoint: <game> <frame> <hash in hex>. */
+
+struct golden {
+    char name[64];
+    uint32_t frame;
+    uint64_t hash;
+};
+
+static struct golden *Golden = NULL;
+static size_t GoldenLen = 0;
+static int GoldenCheck = 0;     // Checking against a golden file?
+
+static int golden_load(const char *path) {
+    FILE *fp = fopen(path,"r");
+    if (!fp) return -1;
+    char name[64];
+    unsigned int frame;
+    unsigned long long hash;
+    while (fscanf(fp,"%63s %u %llx",name,&frame,&hash) == 3) {
+        Golden = realloc(Golden,sizeof(*Golden)*(GoldenLen+1));
+        struct golden *g = Golden+GoldenLen++;
+        snprintf(g->name,sizeof(g->name),"%s",name);
+        g->frame = frame;
+        g->hash = hash;
+    }
+    fclose(fp);
+    GoldenCheck = 1;
+    return 0;
+}
+
+// Return the golden entry for 'name' at 'frame', or NULL.
+static struct golden *golden_lookup(const char *name, uint32_t frame) {
+    for (size_t j = 0; j < GoldenLen; j++)
+        if (!strcmp(Golden[j].name,name) && Golden[j].frame == frame)
+            return Golden+j;
+    return NULL;
+}
+
+static int golden_save(const char *path, struct bench_result *res,
+                       int count)
+{
+    FILE *fp = fopen(path,"w");
+    if (!fp) return -1;
+    for (int j = 0; j < count; j++)
+        for (uint32_t c = 0; c < res[j].checkpoints; c++)
+            fprintf(fp,"%s %u %016llx\n", res[j].name, res[j].cp_frame[c],
+                (unsigned long long)res[j].cp_hash[c]);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* ================================ Benchmark =============================== */
+
+// Run the game for 'frames' frames, with profiling on or off. Hashes are
+// stored into 'hash' every 'every' frames. Returns the elapsed time in
+// nanoseconds, or 0 on error.
+static uint64_t bench_run(struct bench_result *res, uint32_t frames,
+                          uint32_t every, int profile, uint64_t *hash)
+{
+    static zx_t zx;
+    kmap_timeline_t input;
+    if (zxhost_load_game(&zx,res->game) == -1 ||
+        zxhost_load_input(&input,res->game,NULL,NULL) == -1) return 0;
+
+    zxprof_reset();
+    zxprof_enabled = profile;
+    res->ticks = 0;
+    res->input_ns = 0;
+    uint32_t cp = 0;
+    uint64_t elapsed = 0;
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        uint64_t start = zxprof_now();
+        kmap_timeline_run(&input,&zx,frame);
+        uint64_t input_end = zxprof_now();
+        res->ticks += zx_exec(&zx,ZXHOST_FRAME_USEC);
+        uint64_t end = zxprof_now();
+        elapsed += end-start;
+        res->input_ns += input_end-start;
+
+        if ((frame+1) % every == 0 && cp < MAX_CHECKPOINTS) {
+            res->cp_frame[cp] = frame+1;
+            hash[cp++] = zxhost_fb_hash(&zx);
+        }
+    }
+    zxprof_enabled = 0;
+    res->checkpoints = cp;
+    return elapsed;
+}
+
+static void bench_game(struct bench_result *res, uint32_t frames,
+                       uint32_t every)
+{
+    uint64_t prof_hash[MAX_CHECKPOINTS];
+
+    res->status = "error";
+    res->ns = bench_run(res,frames,every,0,res->cp_hash);
+    if (res->ns == 0) return;
+    res->prof_ns = bench_run(res,frames,every,1,prof_hash);
+    if (res->prof_ns == 0) return;
+    for (int s = 0; s < ZX_PROF_COUNT; s++) res->sub_ns[s] = zxprof_ns(s);
+    res->hooks_ns = zxprof_overhead_ns();
+
+    res->status = GoldenCheck ? "ok" : "unchecked";
+    if (memcmp(res->cp_hash,prof_hash,sizeof(uint64_t)*res->checkpoints)) {
+        res->status = "nondeterministic";
+        return;
+    }
+    // A checkpoint missing from the golden file (new game, different
+    // --frames or --checkpoint) is a failure too: nothing was checked.
+    for (uint32_t c = 0; c < res->checkpoints && GoldenCheck; c++) {
+        struct golden *g = golden_lookup(res->name,res->cp_frame[c]);
+        if (g == NULL) {
+            res->status = "no-golden";
+            fprintf(stderr,"%s: frame %u has no golden hash, run "
+                           "'make bench-golden' if the game is new\n",
+                res->name, res->cp_frame[c]);
+        } else if (g->hash != res->cp_hash[c]) {
+            res->status = "mismatch";
+            fprintf(stderr,"%s: frame %u hash %016llx, expected %016llx\n",
+                res->name, res->cp_frame[c],
+                (unsigned long long)res->cp_hash[c],
+                (unsigned long long)g->hash);
+            return;
+        }
+    }
+}
+
+/* ================================= Output ================================= */
+
+static const char *SubsystemNames[ZX_PROF_COUNT] = {"decode","audio","kbd"};
+
+// Time in the profiled run not spent in the subsystems or in the hooks.
+static uint64_t cpu_ns(struct bench_result *r) {
+    uint64_t other = r->input_ns + r->hooks_ns;
+    for (int j = 0; j < ZX_PROF_COUNT; j++) other += r->sub_ns[j];
+    return r->prof_ns > other ? r->prof_ns-other : 0;
+}
+
+// How much slower the profiled run is than the normal one, once the
+// hooks cost is removed, in percent of the normal run.
+static double distortion_pct(struct bench_result *r) {
+    if (r->ns == 0) return 0;
+    return ((double)r->prof_ns-r->hooks_ns-r->ns)*100/r->ns;
+}
+
+static void output_json(struct bench_result *res, int count,
+                        uint32_t frames)
+{
+    printf("{\n  \"frames\": %u,\n  \"games\": [\n", frames);
+    for (int j = 0; j < count; j++) {
+        struct bench_result *r = res+j;
+        double secs = r->ns/1e9;
+        printf("    {\"game\": \"%s\", \"status\": \"%s\", "
+               "\"tstates\": %llu, \"seconds\": %.6f, "
+               "\"tstates_per_sec\": %.0f, \"fps\": %.1f,\n",
+               r->name, r->status, (unsigned long long)r->ticks, secs,
+               secs ? r->ticks/secs : 0, secs ? frames/secs : 0);
+        printf("     \"profile_us\": {\"total\": %llu, \"cpu\": %llu",
+            (unsigned long long)r->prof_ns/1000,
+            (unsigned long long)cpu_ns(r)/1000);
+        for (int s = 0; s < ZX_PROF_COUNT; s++) {
+            uint64_t ns = r->sub_ns[s];
+            if (s == ZX_PROF_KBD) ns += r->input_ns;
+            printf(", \"%s\": %llu", SubsystemNames[s],
+                (unsigned long long)ns/1000);
+        }
+        printf(", \"hooks\": %llu, \"distortion_pct\": %.1f},\n"
+               "     \"hashes\": {",
+            (unsigned long long)r->hooks_ns/1000, distortion_pct(r));
+        for (uint32_t c = 0; c < r->checkpoints; c++)
+            printf("%s\"%u\": \"%016llx\"", c ? ", " : "", r->cp_frame[c],
+                (unsigned long long)r->cp_hash[c]);
+        printf("}}%s\n", j == count-1 ? "" : ",");
+    }
+    printf("  ]\n}\n");
+}
+
+static void output_csv(struct bench_result *res, int count,
+                       uint32_t frames)
+{
+    printf("game,status,frames,tstates,seconds,tstates_per_sec,fps,"
+           "total_us,cpu_us,decode_us,audio_us,kbd_us,hooks_us,"
+           "distortion_pct,final_hash\n");
+    for (int j = 0; j < count; j++) {
+        struct bench_result *r = res+j;
+        double secs = r->ns/1e9;
+        printf("%s,%s,%u,%llu,%.6f,%.0f,%.1f,%llu,%llu,%llu,%llu,%llu,"
+               "%llu,%.1f,%016llx\n",
+            r->name, r->status, frames, (unsigned long long)r->ticks, secs,
+            secs ? r->ticks/secs : 0, secs ? frames/secs : 0,
+            (unsigned long long)r->prof_ns/1000,
+            (unsigned long long)cpu_ns(r)/1000,
+            (unsigned long long)r->sub_ns[ZX_PROF_DECODE]/1000,
+            (unsigned long long)r->sub_ns[ZX_PROF_AUDIO]/1000,
+            (unsigned long long)(r->sub_ns[ZX_PROF_KBD]+r->input_ns)/1000,
+            (unsigned long long)r->hooks_ns/1000, distortion_pct(r),
+            (unsigned long long)(r->checkpoints ?
+                                 r->cp_hash[r->checkpoints-1] : 0));
+    }
+}
+
+static void usage(const char *progname) {
+    fprintf(stderr,
+"Usage: %s [options] <game.z80> ...\n"
+"  --frames <count>     Frames to run for each game (default 500).\n"
+"  --checkpoint <n>     Hash the framebuffer every <n> frames (default 100).\n"
+"  --csv                CSV output instead of JSON.\n"
+"  --golden <file>      Check the hashes against this golden file.\n"
+"  --update-golden      Write the hashes to the golden file instead.\n",
+    progname);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    uint32_t frames = 500, every = 100;
+    int csv = 0, update_golden = 0;
+    const char *golden = NULL;
+    struct bench_result *res = calloc(argc,sizeof(*res));
+    int count = 0;
+
+    for (int j = 1; j < argc; j++) {
+        int moreargs = j+1 < argc;
+        if (!strcmp(argv[j],"--frames") && moreargs) {
+            frames = strtoul(argv[++j],NULL,0);
+        } else if (!strcmp(argv[j],"--checkpoint") && moreargs) {
+            every = strtoul(argv[++j],NULL,0);
+        } else if (!strcmp(argv[j],"--golden") && moreargs) {
+            golden = argv[++j];
+        } else if (!strcmp(argv[j],"--update-golden")) {
+            update_golden = 1;
+        } else if (!strcmp(argv[j],"--csv")) {
+            csv = 1;
+        } else if (argv[j][0] != '-') {
+            struct bench_result *r = res+count++;
+            const char *p = strrchr(argv[j],'/');
+            r->game = argv[j];
+            snprintf(r->name,sizeof(r->name),"%s",p ? p+1 : argv[j]);
+            char *dot = strrchr(r->name,'.');
+            if (dot) *dot = 0;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (count == 0 || every == 0 || (update_golden && !golden))
+        usage(argv[0]);
+    if (golden && !update_golden && golden_load(golden) == -1) {
+        perror(golden);
+        exit(1);
+    }
+
+    zxprof_calibrate();
+    fprintf(stderr,"Profiling hooks: %.1f ns per call, %.1f ns measured "
+                   "inside the subsystems\n",
+        zxprof_pair_cycles/zxprof_cycles_per_ns,
+        zxprof_inner_cycles/zxprof_cycles_per_ns);
+
+    int failed = 0;
+    for (int j = 0; j < count; j++) {
+        fprintf(stderr,"%s...\n",res[j].name);
+        bench_game(res+j,frames,every);
+        if (strcmp(res[j].status,"ok") && strcmp(res[j].status,"unchecked"))
+            failed = 1;
+    }
+
+    if (csv)
+        output_csv(res,count,frames);
+    else
+        output_json(res,count,frames);
+
+    if (update_golden) {
+        if (golden_save(golden,res,count) == -1) {
+            perror(golden);
+            exit(1);
+        }
+        fprintf(stderr,"Golden hashes written to %s\n",golden);
+    }
+    return failed;
+}
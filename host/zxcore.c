@@ -0,0 +1,87 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info. */
+
+/* The emulator core implementation for the host build. Just like zx.c
+ * does on the device, we include the chips headers with CHIPS_IMPL
+ * defined, but here the result is a static library that the host
+ * tools link against. */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico_shim.h"
+
+#define CHIPS_IMPL
+#include "zxcore.h"
+#include "zx-roms.h"
+
+#ifdef ZX_PROFILE
+int zxprof_enabled = 0;
+uint64_t zxprof_start[ZX_PROF_COUNT];
+uint64_t zxprof_cycles[ZX_PROF_COUNT];
+uint64_t zxprof_calls[ZX_PROF_COUNT];
+double zxprof_cycles_per_ns = 1;
+double zxprof_inner_cycles = 0;
+double zxprof_pair_cycles = 0;
+
+void zxprof_reset(void) {
+    memset(zxprof_cycles,0,sizeof(zxprof_cycles));
+    memset(zxprof_calls,0,sizeof(zxprof_calls));
+}
+
+// Measure the counter rate against the monotonic clock, then run many
+// empty BEGIN/END pairs: what they accumulate is the part of the hooks
+// cost that ends up inside the measured subsystems, and their wall time
+// is the whole cost added to the profiled run.
+void zxprof_calibrate(void) {
+    uint64_t ns = zxprof_now(), cycles = zxprof_counter();
+    while (zxprof_now()-ns < 20000000);
+    zxprof_cycles_per_ns =
+        (double)(zxprof_counter()-cycles)/(zxprof_now()-ns);
+
+    // The best of a few runs, to skip preemptions.
+    const uint32_t pairs = 100000;
+    zxprof_inner_cycles = zxprof_pair_cycles = 1e18;
+    int enabled = zxprof_enabled;
+    zxprof_enabled = 1;
+    for (int run = 0; run < 5; run++) {
+        zxprof_reset();
+        uint64_t start = zxprof_counter();
+        for (uint32_t j = 0; j < pairs; j++) {
+            ZX_PROFILE_BEGIN(0);
+            __asm__ volatile("" ::: "memory");
+            ZX_PROFILE_END(0);
+        }
+        double pair = (double)(zxprof_counter()-start)/pairs;
+        double inner = (double)zxprof_cycles[0]/pairs;
+        if (pair < zxprof_pair_cycles) zxprof_pair_cycles = pair;
+        if (inner < zxprof_inner_cycles) zxprof_inner_cycles = inner;
+    }
+    zxprof_enabled = enabled;
+    zxprof_reset();
+}
+
+// Nanoseconds spent in the subsystem 'what', without what the hooks
+// themselves measured.
+uint64_t zxprof_ns(int what) {
+    double cycles = zxprof_cycles[what] -
+                    zxprof_calls[what]*zxprof_inner_cycles;
+    return cycles > 0 ? cycles/zxprof_cycles_per_ns : 0;
+}
+
+// Nanoseconds the hooks added to the profiled run.
+uint64_t zxprof_overhead_ns(void) {
+    uint64_t calls = 0;
+    for (int j = 0; j < ZX_PROF_COUNT; j++) calls += zxprof_calls[j];
+    return calls*zxprof_pair_cycles/zxprof_cycles_per_ns;
+}
+#endif
+
+void zxcore_init(zx_t *zx) {
+    zx_desc_t zx_desc = {0};
+    zx_desc.type = ZX_TYPE_48K;
+    zx_desc.joystick_type = ZX_JOYSTICKTYPE_KEMPSTON;
+    zx_desc.roms.zx48k.ptr = dump_amstrad_zx48k_bin;
+    zx_desc.roms.zx48k.size = sizeof(dump_amstrad_zx48k_bin);
+    zx_init(zx, &zx_desc);
+}
@@ -0,0 +1,21 @@
+/* Host build of the emulator core: include this file to use the
+ * z80.h / zx.h API from the zxcore library. */
+
+#pragma once
+#include "pico_shim.h"
+#ifdef ZX_PROFILE
+#include "zxprof.h"
+#endif
+#include "chips_common.h"
+#include "mem.h"
+#include "z80.h"
+#include "kbd.h"
+#include "clk.h"
+#include "zx.h"
+
+// The 48k ROM image, from zx-roms.h.
+extern unsigned char dump_amstrad_zx48k_bin[16384];
+
+// Initialize 'zx' as a 48k Spectrum with Kempston joystick, exactly
+// like the emulator does on the device.
+void zxcore_init(zx_t *zx);
@@ -0,0 +1,192 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info. */
+
+/* update_display() microbenchmark. The whole zx.c is compiled on the
+ * host against the stand-in SDK headers of the 'sdk' directory, where
+ * the display bus just counts and hashes the bytes written. The display
+ * size is fixed at compile time like on the device, so one executable
+ * is built for each size (zxdisplay_<width>x<height>).
+ *
+ * For every scaling and border mode, and for a few framebuffers (noise,
+ * flat color, game screens), the time per display line and the bytes
+ * sent are reported as CSV, with the hash of the bytes, so that changes
+ * to the scaler can be checked to produce the same output:
+ *
+ *   zxdisplay_320x240 --golden display-golden.txt
+ *
+ * checks the hashes against the golden file, and --update-golden
+ * rewrites the lines of this display size in it. */
+
+#define ZX_NO_MAIN
+#include "zx.c"
+#include <stdlib.h>
+
+#define REPS 100    // update_display() calls per measure.
+
+static const char *ScreenNames[] = {
+    "noise", "flat", "jetpac", "skooldaze", "sabre", NULL
+};
+
+// Fill the Spectrum framebuffer with the screen 'id'. Game screens are
+// taken after running the game for a while. Returns 0 on success.
+int load_screen(int id, const char *gamesdir) {
+    uint8_t *fb = EMU.zx.fb;
+    if (id == 0) {
+        uint32_t x = 1234567;
+        for (int j = 0; j < ZX_FRAMEBUFFER_SIZE_BYTES; j++) {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            fb[j] = x;
+        }
+        return 0;
+    } else if (id == 1) {
+        memset(fb,0x77,ZX_FRAMEBUFFER_SIZE_BYTES);
+        return 0;
+    }
+
+    char path[1024];
+    snprintf(path,sizeof(path),"%s/%s.z80",gamesdir,ScreenNames[id]);
+    FILE *fp = fopen(path,"rb");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    static uint8_t buf[65536*2];
+    size_t len = fread(buf,1,sizeof(buf),fp);
+    fclose(fp);
+
+    zx_desc_t zx_desc = {0};
+    zx_desc.type = ZX_TYPE_48K;
+    zx_desc.joystick_type = ZX_JOYSTICKTYPE_KEMPSTON;
+    zx_desc.roms.zx48k.ptr = dump_amstrad_zx48k_bin;
+    zx_desc.roms.zx48k.size = sizeof(dump_amstrad_zx48k_bin);
+    zx_init(&EMU.zx, &zx_desc);
+    chips_range_t r = {.ptr=buf, .size=len};
+    if (!zx_quickload(&EMU.zx, r)) return -1;
+
+    // Use the builtin keymap macros to get past the menus.
+    kmap_timeline_build(&EMU.macros,builtin_keymap_lookup(ScreenNames[id]));
+    for (uint32_t frame = 0; frame < 300; frame++) {
+        kmap_timeline_run(&EMU.macros,&EMU.zx,frame);
+        zx_exec(&EMU.zx,FRAME_USEC);
+    }
+    return 0;
+}
+
+/* ============================== Golden file ===============================
+ * One line per measure: <width>x<height> <scaling> <border> <screen> <hash>.
+ * This display size lines are rewritten or checked, the others kept. */
+
+#define MAX_GOLDEN 1024
+static char *GoldenLines[MAX_GOLDEN];
+static int GoldenCount = 0;
+
+static void golden_load(const char *path) {
+    FILE *fp = fopen(path,"r");
+    char line[256];
+    if (!fp) return;
+    while (GoldenCount < MAX_GOLDEN && fgets(line,sizeof(line),fp))
+        GoldenLines[GoldenCount++] = strdup(line);
+    fclose(fp);
+}
+
+// Return true if 'line' is part of the golden file (same display size).
+static int golden_check(const char *line) {
+    for (int j = 0; j < GoldenCount; j++)
+        if (!strcmp(GoldenLines[j],line)) return 1;
+    return 0;
+}
+
+static int golden_save(const char *path, const char *display,
+                       char **lines, int count)
+{
+    FILE *fp = fopen(path,"w");
+    if (!fp) return -1;
+    for (int j = 0; j < GoldenCount; j++)
+        if (strncmp(GoldenLines[j],display,strlen(display)) ||
+            GoldenLines[j][strlen(display)] != ' ')
+            fputs(GoldenLines[j],fp);
+    for (int j = 0; j < count; j++) fputs(lines[j],fp);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    const char *gamesdir = "games", *golden = NULL;
+    int update = 0;
+
+    for (int j = 1; j < argc; j++) {
+        int moreargs = j+1 < argc;
+        if (!strcmp(argv[j],"--games") && moreargs) {
+            gamesdir = argv[++j];
+        } else if (!strcmp(argv[j],"--golden") && moreargs) {
+            golden = argv[++j];
+        } else if (!strcmp(argv[j],"--update-golden")) {
+            update = 1;
+        } else {
+            fprintf(stderr,"Usage: %s [--games <dir>] [--golden <file>] "
+                           "[--update-golden]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (update && !golden) {
+        fprintf(stderr,"--update-golden requires --golden\n");
+        exit(1);
+    }
+    if (golden) golden_load(golden);
+
+    // Like init_emulator() does at startup.
+    for (int j = 0; j < 16; j++)
+        zxpalette[j] = palette_to_565(zxpalette[j]);
+
+    char display[32];
+    snprintf(display,sizeof(display),"%dx%d",st77_width,st77_height);
+    char *lines[256];
+    int count = 0, failed = 0;
+
+    printf("display,scaling,border,screen,ns_per_line,lines,"
+           "pixel_bytes,bus_bytes,us_per_frame,hash\n");
+    for (int screen = 0; ScreenNames[screen]; screen++) {
+        if (load_screen(screen,gamesdir) == -1) exit(1);
+        for (uint32_t s = 0; s < sizeof(SettingsZoomValues)/sizeof(uint32_t);
+             s++)
+        {
+            for (uint32_t border = 0; border <= 1; border++) {
+                uint32_t scaling = SettingsZoomValues[s];
+
+                // The first call is just for the output hash.
+                HostBus.bytes = 0;
+                HostBus.hash = 0xcbf29ce484222325ULL;
+                uint32_t pixel_bytes = update_display(scaling,border);
+                uint64_t hash = HostBus.hash, bus_bytes = HostBus.bytes;
+
+                uint64_t start = time_us_64();
+                for (int r = 0; r < REPS; r++)
+                    update_display(scaling,border);
+                uint64_t elapsed = time_us_64()-start;
+
+                uint32_t lines_out = pixel_bytes/(st77_width*2);
+                printf("%s,%u,%u,%s,%.1f,%u,%u,%llu,%.1f,%016llx\n",
+                    display, scaling, border, ScreenNames[screen],
+                    lines_out ? elapsed*1000.0/REPS/lines_out : 0,
+                    lines_out, pixel_bytes, (unsigned long long)bus_bytes,
+                    (double)elapsed/REPS, (unsigned long long)hash);
+
+                char line[256];
+                snprintf(line,sizeof(line),"%s %u %u %s %016llx\n",
+                    display, scaling, border, ScreenNames[screen],
+                    (unsigned long long)hash);
+                if (golden && !update && !golden_check(line)) {
+                    fprintf(stderr,"Output changed: %s",line);
+                    failed = 1;
+                }
+                if (count < 256) lines[count++] = strdup(line);
+            }
+        }
+    }
+
+    if (update && golden_save(golden,display,lines,count) == -1) {
+        perror(golden);
+        exit(1);
+    }
+    return failed;
+}
@@ -0,0 +1,148 @@
+/* Helpers shared by the host tools: loading games and scripted input,
+ * hashing and dumping the framebuffer. Include it after zxcore.h, in a
+ * single translation unit per program, like kmap.h in zx.c. */
+
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "zxcore.h"
+#include "kmap.h"
+
+// The host has no device pins: the builtin keymaps of keymaps.h are
+// compiled with the logical buttons of kmap.h instead. The host tools only
+// use the key macros of such maps anyway.
+#define KEY_LEFT    KMAP_BTN_LEFT
+#define KEY_RIGHT   KMAP_BTN_RIGHT
+#define KEY_FIRE    KMAP_BTN_FIRE
+#define KEY_UP      KMAP_BTN_UP
+#define KEY_DOWN    KMAP_BTN_DOWN
+#include "keymaps.h"
+
+#define ZXHOST_FRAME_USEC 25000 // Must match FRAME_USEC in zx.c.
+
+// Read the whole file at 'path'. Returns a malloc()ated buffer and sets
+// '*len', or NULL on error.
+uint8_t *zxhost_read_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path,"rb");
+    if (!fp) return NULL;
+    uint8_t *buf = NULL;
+    if (fseek(fp,0,SEEK_END) == 0) {
+        long size = ftell(fp);
+        rewind(fp);
+        buf = size > 0 ? malloc(size) : NULL;
+        if (buf && fread(buf,1,size,fp) != (size_t)size) {
+            free(buf);
+            buf = NULL;
+        }
+        *len = size;
+    }
+    fclose(fp);
+    return buf;
+}
+
+// Initialize 'zx' and load the .z80 snapshot at 'path' into it.
+// Returns 0 on success, -1 on error (an error is printed).
+int zxhost_load_game(zx_t *zx, const char *path) {
+    size_t len;
+    uint8_t *data = zxhost_read_file(path,&len);
+    if (!data) {
+        fprintf(stderr,"Can't read %s\n",path);
+        return -1;
+    }
+    zxcore_init(zx);
+    chips_range_t r = {.ptr=data, .size=len};
+    bool ok = zx_quickload(zx,r);
+    free(data);
+    if (!ok) {
+        fprintf(stderr,"%s is not a valid .z80 snapshot\n",path);
+        return -1;
+    }
+    return 0;
+}
+
+// Build the input timeline 'tl' for the game at 'path'. If 'keys' is
+// given, it is a binary keymap file (see games/kmap.py), otherwise the
+// builtin keymap named 'keymap' is used, or if that's NULL too, the one
+// with the same name of the game file. Only the key macros of the map
+// matter here. Returns 0 on success, -1 on error.
+int zxhost_load_input(kmap_timeline_t *tl, const char *path,
+                      const char *keys, const char *keymap)
+{
+    static const uint8_t pins[KMAP_BTN_COUNT] = {
+        KEY_LEFT, KEY_RIGHT, KEY_FIRE, KEY_UP, KEY_DOWN
+    };
+    uint8_t buf[KMAP_MAX_ROWS*3];
+    const uint8_t *map;
+
+    if (keys) {
+        size_t len;
+        const char *err;
+        uint8_t *data = zxhost_read_file(keys,&len);
+        if (!data) {
+            fprintf(stderr,"Can't read %s\n",keys);
+            return -1;
+        }
+        int retval = kmap_load(buf,data,len,pins,&err);
+        free(data);
+        if (retval == -1) {
+            fprintf(stderr,"%s: %s\n",keys,err);
+            return -1;
+        }
+        map = buf;
+    } else {
+        char name[64];
+        if (!keymap) {
+            // Game name: file name without directory and extension.
+            const char *p = strrchr(path,'/');
+            p = p ? p+1 : path;
+            snprintf(name,sizeof(name),"%s",p);
+            char *dot = strrchr(name,'.');
+            if (dot) *dot = 0;
+            keymap = name;
+        }
+        map = builtin_keymap_lookup(keymap);
+    }
+    if (kmap_timeline_build(tl,map))
+        fprintf(stderr,"Warning: too many key macros, some dropped\n");
+    return 0;
+}
+
+// 64 bit FNV-1a hash of the framebuffer. Used to compare the output of
+// different builds of the emulator frame by frame.
+uint64_t zxhost_fb_hash(const zx_t *zx) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t j = 0; j < sizeof(zx->fb); j++) {
+        h ^= zx->fb[j];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Write the framebuffer as a binary PPM image, converting the 4 bits
+// pixels with the palette of zx_display_info(). Returns 0 on success,
+// -1 on error.
+int zxhost_write_ppm(zx_t *zx, const char *path) {
+    chips_display_info_t di = zx_display_info(zx);
+    const uint32_t *palette = di.palette.ptr;
+    FILE *fp = fopen(path,"wb");
+    if (!fp) return -1;
+
+    fprintf(fp,"P6\n%d %d\n255\n",ZX_DISPLAY_WIDTH,ZX_DISPLAY_HEIGHT);
+    uint8_t row[ZX_DISPLAY_WIDTH*3];
+    for (int y = 0; y < ZX_DISPLAY_HEIGHT; y++) {
+        const uint8_t *src = zx->fb+y*ZX_FRAMEBUFFER_WIDTH;
+        for (int x = 0; x < ZX_DISPLAY_WIDTH; x++) {
+            // Two pixels per byte, the left one in the high nibble.
+            uint8_t color = (x & 1) ? src[x/2] & 0xf : src[x/2] >> 4;
+            uint32_t abgr = palette[color];
+            row[x*3] = abgr & 0xff;
+            row[x*3+1] = (abgr >> 8) & 0xff;
+            row[x*3+2] = (abgr >> 16) & 0xff;
+        }
+        fwrite(row,sizeof(row),1,fp);
+    }
+    return fclose(fp) == 0 ? 0 : -1;
+}
@@ -0,0 +1,62 @@
+/* Implementation of the zx.h profiling hooks for the host build, used
+ * when the core is compiled with ZX_PROFILE defined (the zxcore_prof
+ * library). The hooks run around every audio sample and every scanline,
+ * so they must be cheap: they read the CPU cycle counter (rdtsc on x86,
+ * the virtual counter on ARM64, clock_gettime() elsewhere) and add up
+ * the cycles and the calls per subsystem, only while zxprof_enabled is
+ * true, so that the same binary can also measure the speed without the
+ * timing overhead.
+ *
+ * zxprof_calibrate() measures the counter rate and the cost of the hooks
+ * themselves, so that zxprof_ns() can subtract it from the totals. */
+
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+extern int zxprof_enabled;
+extern uint64_t zxprof_start[];   // Indexed by ZX_PROF_*.
+extern uint64_t zxprof_cycles[];  // Total counter cycles, by ZX_PROF_*.
+extern uint64_t zxprof_calls[];   // BEGIN/END pairs, by ZX_PROF_*.
+
+// Set by zxprof_calibrate().
+extern double zxprof_cycles_per_ns;
+extern double zxprof_inner_cycles; // Cycles an empty pair measures.
+extern double zxprof_pair_cycles;  // Cycles an enabled pair costs.
+
+static inline uint64_t zxprof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t zxprof_counter(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return zxprof_now();
+#endif
+}
+
+#define ZX_PROFILE_BEGIN(what) do { \
+    if (zxprof_enabled) zxprof_start[what] = zxprof_counter(); \
+} while(0)
+
+#define ZX_PROFILE_END(what) do { \
+    if (zxprof_enabled) { \
+        zxprof_cycles[what] += zxprof_counter()-zxprof_start[what]; \
+        zxprof_calls[what]++; \
+    } \
+} while(0)
+
+void zxprof_calibrate(void);
+void zxprof_reset(void);
+uint64_t zxprof_ns(int what);
+uint64_t zxprof_overhead_ns(void);
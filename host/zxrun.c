@@ -0,0 +1,181 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info. */
+
+/* Headless runner: load a game, run it for a given number of frames
+ * with scripted input, optionally hashing and dumping every frame.
+ *
+ *   zxrun game.z80 --frames 500 --keys movie.bin --dump-ppm out/ --hash
+ *
+ * At exit the emulation speed is reported. The --hash output can be
+ * compared across builds to detect changes in the emulation or in the
+ * video decoding.
+ *
+ * With --hypercalls the guest can use the hypercall port (see zx.h) to
+ * time regions of its own code, report counters and request snapshots
+ * (written as PPM images in the --dump-ppm directory, if given). */
+
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "zxhost.h"
+
+static void usage(const char *progname) {
+    fprintf(stderr,
+"Usage: %s <game.z80> [options]\n"
+"  --frames <count>     Frames to run (default 500).\n"
+"  --keys <file>        Scripted input: binary keymap, see games/kmap.py.\n"
+"  --keymap <name>      Use the key macros of a builtin keymap. By default\n"
+"                       the builtin keymap with the game name is used.\n"
+"  --dump-ppm <dir>     Write every frame as <dir>/frame-NNNNN.ppm.\n"
+"  --dump-every <n>     Only dump one frame every <n> (default 1).\n"
+"  --hash               Print the framebuffer hash of every frame.\n"
+"  --usec <us>          Emulated microseconds per frame (default %d).\n"
+"  --hypercalls         Enable the guest hypercall port.\n",
+    progname, ZXHOST_FRAME_USEC);
+    exit(1);
+}
+
+/* =============================== Hypercalls =============================== */
+
+#define HCALL_REGIONS 16
+
+static struct {
+    uint32_t frame;                 // Current frame.
+    const char *ppmdir;             // Where to write snapshots, or NULL.
+    uint64_t start[HCALL_REGIONS];  // Start time of the open regions, ns.
+    uint64_t total[HCALL_REGIONS];  // Time spent in each region, ns.
+    uint32_t count[HCALL_REGIONS];  // Times each region was entered.
+} Hcall;
+
+static uint64_t hcall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static void hcall(zx_t *zx, uint8_t cmd, uint16_t hl, uint16_t de) {
+    switch(cmd) {
+    case ZX_HCALL_BEGIN:
+    case ZX_HCALL_END:
+        if (hl >= HCALL_REGIONS) {
+            printf("hcall frame %u: region %u out of range\n",
+                Hcall.frame, hl);
+        } else if (cmd == ZX_HCALL_BEGIN) {
+            Hcall.start[hl] = hcall_ns();
+        } else if (Hcall.start[hl]) {
+            Hcall.total[hl] += hcall_ns()-Hcall.start[hl];
+            Hcall.count[hl]++;
+            Hcall.start[hl] = 0;
+        }
+        break;
+    case ZX_HCALL_COUNTER:
+        printf("hcall frame %u: counter %u = %u\n", Hcall.frame, de, hl);
+        break;
+    case ZX_HCALL_SNAPSHOT:
+        printf("hcall frame %u: snapshot %u %016llx\n", Hcall.frame, hl,
+            (unsigned long long)zxhost_fb_hash(zx));
+        if (Hcall.ppmdir) {
+            char path[1024];
+            snprintf(path,sizeof(path),"%s/snapshot-%05u.ppm",
+                Hcall.ppmdir,hl);
+            if (zxhost_write_ppm(zx,path) == -1) perror(path);
+        }
+        break;
+    default:
+        printf("hcall frame %u: unknown command %u\n", Hcall.frame, cmd);
+        break;
+    }
+}
+
+// Report the time spent in the regions marked by the guest.
+static void hcall_report(void) {
+    for (int j = 0; j < HCALL_REGIONS; j++) {
+        if (Hcall.count[j] == 0) continue;
+        printf("hcall region %d: %u times, %.3f ms, %.1f us each\n",
+            j, Hcall.count[j], Hcall.total[j]/1e6,
+            Hcall.total[j]/1e3/Hcall.count[j]);
+    }
+}
+
+/* ================================== Main ================================== */
+
+int main(int argc, char **argv) {
+    const char *game = NULL, *keys = NULL, *keymap = NULL, *ppmdir = NULL;
+    uint32_t frames = 500, usec = ZXHOST_FRAME_USEC, dump_every = 1;
+    int hash = 0, hypercalls = 0;
+
+    for (int j = 1; j < argc; j++) {
+        int moreargs = j+1 < argc;
+        if (!strcmp(argv[j],"--frames") && moreargs) {
+            frames = strtoul(argv[++j],NULL,0);
+        } else if (!strcmp(argv[j],"--keys") && moreargs) {
+            keys = argv[++j];
+        } else if (!strcmp(argv[j],"--keymap") && moreargs) {
+            keymap = argv[++j];
+        } else if (!strcmp(argv[j],"--dump-ppm") && moreargs) {
+            ppmdir = argv[++j];
+        } else if (!strcmp(argv[j],"--dump-every") && moreargs) {
+            dump_every = strtoul(argv[++j],NULL,0);
+        } else if (!strcmp(argv[j],"--usec") && moreargs) {
+            usec = strtoul(argv[++j],NULL,0);
+        } else if (!strcmp(argv[j],"--hash")) {
+            hash = 1;
+        } else if (!strcmp(argv[j],"--hypercalls")) {
+            hypercalls = 1;
+        } else if (argv[j][0] != '-' && game == NULL) {
+            game = argv[j];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (game == NULL || usec == 0 || dump_every == 0) usage(argv[0]);
+    if (ppmdir && mkdir(ppmdir,0755) == -1 && errno != EEXIST) {
+        perror(ppmdir);
+        exit(1);
+    }
+
+    static zx_t zx;
+    kmap_timeline_t input;
+    if (zxhost_load_game(&zx,game) == -1 ||
+        zxhost_load_input(&input,game,keys,keymap) == -1) exit(1);
+    if (hypercalls) {
+        Hcall.ppmdir = ppmdir;
+        zx_hypercall_enable(&zx,hcall);
+    }
+
+    // Run. Only the time spent in zx_exec() is accounted for the speed
+    // report, hashing and dumping are not part of the emulation.
+    uint64_t ticks = 0, elapsed = 0;
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        // Like the emulator main loop: input first, then the frame.
+        kmap_timeline_run(&input,&zx,frame);
+        Hcall.frame = frame;
+        absolute_time_t start = get_absolute_time();
+        ticks += zx_exec(&zx,usec);
+        elapsed += get_absolute_time()-start;
+
+        if (hash)
+            printf("frame %u %016llx\n", frame,
+                (unsigned long long)zxhost_fb_hash(&zx));
+        if (ppmdir && frame % dump_every == 0) {
+            char path[1024];
+            snprintf(path,sizeof(path),"%s/frame-%05u.ppm",ppmdir,frame);
+            if (zxhost_write_ppm(&zx,path) == -1) {
+                perror(path);
+                exit(1);
+            }
+        }
+    }
+
+    if (hypercalls) hcall_report();
+    double secs = elapsed ? elapsed/1000000.0 : 1e-6;
+    printf("final %016llx\n", (unsigned long long)zxhost_fb_hash(&zx));
+    fprintf(stderr,
+        "%u frames, %llu ticks in %.3f s: %.2f MHz emulated, "
+        "%.1f frames/s (%.1fx realtime)\n",
+        frames, (unsigned long long)ticks, secs,
+        ticks/secs/1000000.0, frames/secs,
+        (double)frames*usec/1000000.0/secs);
+    return 0;
+}
@@ -0,0 +1,62 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info. */
+
+/* Thumbnail generator, used by games/loadgames.py: run a game for a
+ * given number of frames with its scripted input, then write the
+ * thumbnail of the screen (see thumb.h).
+ *
+ *   zxthumb game.z80 game.thumb --frames 400 --keys game.bin */
+
+#include "zxhost.h"
+#include "thumb.h"
+
+static void usage(const char *progname) {
+    fprintf(stderr,
+"Usage: %s <game.z80> <output> [options]\n"
+"  --frames <count>     Frames to run before the capture (default 400).\n"
+"  --keys <file>        Scripted input: binary keymap, see games/kmap.py.\n"
+"                       By default the builtin keymap with the game name\n"
+"                       is used.\n",
+    progname);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *game = NULL, *output = NULL, *keys = NULL;
+    uint32_t frames = 400;
+
+    for (int j = 1; j < argc; j++) {
+        int moreargs = j+1 < argc;
+        if (!strcmp(argv[j],"--frames") && moreargs) {
+            frames = strtoul(argv[++j],NULL,0);
+        } else if (!strcmp(argv[j],"--keys") && moreargs) {
+            keys = argv[++j];
+        } else if (argv[j][0] != '-' && game == NULL) {
+            game = argv[j];
+        } else if (argv[j][0] != '-' && output == NULL) {
+            output = argv[j];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (game == NULL || output == NULL) usage(argv[0]);
+
+    static zx_t zx;
+    kmap_timeline_t input;
+    if (zxhost_load_game(&zx,game) == -1 ||
+        zxhost_load_input(&input,game,keys,NULL) == -1) exit(1);
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        kmap_timeline_run(&input,&zx,frame);
+        zx_exec(&zx,ZXHOST_FRAME_USEC);
+    }
+
+    uint8_t thumb[THUMB_BYTES];
+    thumb_from_fb(zx.fb,thumb);
+    FILE *fp = fopen(output,"wb");
+    if (!fp || fwrite(thumb,sizeof(thumb),1,fp) != 1 || fclose(fp) != 0) {
+        perror(output);
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+/* Copyright (C) 2024 Salvatore Sanfilippo -- All Rights Reserved.
+ * This code is released under the MIT license.
+ * See the LICENSE file for more info. */
+
+/* ui_draw_menu() microbenchmark. Like zxdisplay.c, the whole zx.c is
+ * compiled on the host. The games list is built from the names of the
+ * .z80 files given (the game files are not read), then the menu is drawn
+ * with every item selected in turn, and the time per call is reported,
+ * both forcing a redraw and when nothing changed, and per navigation
+ * event (checking that the incremental update draws the same pixels of
+ * a full redraw), together with the hash of the display output, so that
+ * changes to the UI primitives can be checked to draw the same pixels:
+ *
+ *   zxui [--expect <hash>] games/NAME.z80 ...
+ *
+ * With --expect the exit code is 1 if the hash is not the one given.
+ */
+
+#define ZX_NO_MAIN
+#include "zx.c"
+#include <libgen.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#define REPS 200    // ui_draw_menu() calls for each selected item.
+
+int main(int argc, char **argv) {
+    const char *expect = NULL;
+    for (int j = 1; j < argc && GamesTableSize < GAMES_MAX; j++) {
+        if (!strcmp(argv[j],"--expect") && j+1 < argc) {
+            expect = argv[++j];
+            continue;
+        }
+        // Same naming as games/loadgames.py.
+        struct game_entry *g = GamesTable+GamesTableSize++;
+        char *base = basename(argv[j]);
+        snprintf(g->name,sizeof(g->name),"%.*s",
+            (int)strcspn(base,"."),base);
+        g->name[0] = toupper(g->name[0]);
+    }
+
+    EMU.emu_clock = 400000;
+    EMU.show_border = 1;
+    EMU.scaling = 100;
+    EMU.volume = 20;
+    EMU.audio_sample_wait = 370;
+    ui_reset_crop_area();
+    // ui_draw_char() reads the font from the ROM copy zx_init() makes.
+    memcpy(EMU.zx.rom[0],dump_amstrad_zx48k_bin,sizeof(EMU.zx.rom[0]));
+
+    uint64_t hash = 0xcbf29ce484222325ULL, elapsed = 0, idle = 0;
+    uint32_t calls = 0;
+    for (int sel = -(int)SettingsListLen; sel < (int)GamesTableSize; sel++) {
+        // Hash what reaches the display, menu over a pattern.
+        EMU.selected_game = sel;
+        for (int j = 0; j < ZX_FRAMEBUFFER_SIZE_BYTES; j++)
+            EMU.zx.fb[j] = j*7;
+        EMU.menu_redraw = 1;
+        ui_draw_menu();
+        ui_show_menu(1);
+        HostBus.hash = hash;
+        update_display(100,1);
+        hash = HostBus.hash;
+
+        uint64_t start = time_us_64();
+        for (int r = 0; r < REPS; r++) {
+            EMU.menu_redraw = 1;
+            ui_draw_menu();
+        }
+        elapsed += time_us_64()-start;
+
+        start = time_us_64();
+        for (int r = 0; r < REPS; r++) ui_draw_menu();
+        idle += time_us_64()-start;
+        calls += REPS;
+    }
+    ui_show_menu(0);
+
+    // Navigation: move the selection down and up the whole list, and
+    // change the audio sync value, like the UI events do. Every
+    // incremental update is checked against a full redraw.
+    static uint8_t incremental[sizeof(UIMenuBuf)];
+    uint64_t nav = 0;
+    uint32_t steps = 0, mismatches = 0;
+    int last = (int)GamesTableSize-1, first = -(int)SettingsListLen;
+    for (int step = 0; step < 2*(last-first)+8; step++) {
+        int pos = step % (2*(last-first));
+        if (step >= 2*(last-first))
+            EMU.audio_sample_wait += 5;
+        else
+            EMU.selected_game = pos <= last-first ?
+                first+pos : last-(pos-(last-first));
+
+        uint64_t start = time_us_64();
+        ui_draw_menu();
+        nav += time_us_64()-start;
+        steps++;
+
+        memcpy(incremental,UIMenuBuf,sizeof(UIMenuBuf));
+        EMU.menu_redraw = 1;
+        ui_draw_menu();
+        if (memcmp(incremental,UIMenuBuf,sizeof(UIMenuBuf))) mismatches++;
+    }
+
+    // Strings at odd and even positions, sizes 1 to 3, with a crop
+    // area clipping them on every side, just for the hash.
+    memset(EMU.zx.fb,0,ZX_FRAMEBUFFER_SIZE_BYTES);
+    ui_set_crop_area(13,250,21,200);
+    for (int size = 1; size <= 3; size++) {
+        for (int x = 0; x < 4; x++) {
+            int y = 16+(size-1)*64+x*(8*size)/2;
+            ui_draw_string(x+(size-1)*3,y,"Jetpac ~{|}",size+x,size);
+        }
+    }
+    ui_reset_crop_area();
+    for (int j = 0; j < ZX_FRAMEBUFFER_SIZE_BYTES; j++)
+        hash = (hash ^ EMU.zx.fb[j]) * 0x100000001b3ULL;
+
+    printf("ui_draw_menu: %u games, %.2f us per call, %.2f us idle, "
+           "%.2f us per event, hash %016llx\n", GamesTableSize,
+           (double)elapsed/calls, (double)idle/calls, (double)nav/steps,
+           (unsigned long long)hash);
+    if (mismatches) {
+        printf("%u incremental updates differ from a full redraw\n",
+            mismatches);
+        return 1;
+    }
+    if (expect && strtoull(expect,NULL,16) != hash) {
+        printf("hash mismatch, expected %s\n", expect);
+        return 1;
+    }
+    return 0;
+}
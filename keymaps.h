@@ -1,36 +1,5 @@
-// Kempston joystick key codes.
-#define KEMPSTONE_FIRE 0xff
-#define KEMPSTONE_LEFT 0xfe
-#define KEMPSTONE_RIGHT 0xfd
-#define KEMPSTONE_DOWN 0xfc
-#define KEMPSTONE_UP 0xfb
-
-// "Virtual" pins.
-//
-// PRESS_AT_TICK is specified when we want a key to be pressed
-// after the game starts, when a specific tick (frame) is reached.
-// This is often useful in order to select the joystick or for
-// similar tasks.
-//
-// Just specify PRESS_AT_TICK as pin, then the frame number, and
-// finally the key.
-#define PRESS_AT_TICK   0xfe // Press at the specified frame.
-#define RELEASE_AT_TICK 0xfd // Release at the specified frame.
-#define KEY_END         0xff // This just marks the end of the key map.
-
-// Extended keymaps allow two device buttons (pins) to map to
-// other Specturm keys. This is useful for games such as Skool Daze
-// that have too many keys doing useful things, but where the nature
-// of the game don't make likely we press multiple keys for error.
-// 
-// To use this kind of maps, xor KEY_EXT to the first pin, then
-// provide as second entry in the row the second pin, and finally
-// a single Spectrum key code to trigger.
-// 
-// IMPORTANT: the extended key maps of a game must be the initial entries,
-// before the normal entries. This way we avoid also sensing the keys
-// mapped to the single buttons involved.
-#define KEY_EXT         0x80
+// Games keymaps. The rows format, the Kempston key codes and the
+// "virtual" pins used for key macros are described in kmap.h.
 
 /* Each row is: pin, keycode_1, keycode_2.
  *
@@ -218,3 +187,35 @@ const uint8_t keymap_sanxion[] = {
 
 // 3D show demo
 #define keymap_3dshow_demo keymap_default
+
+// Keymaps compiled into the emulator, by game file name (without the
+// .z80 extension). Used for games that don't have a keymap stored in
+// the flash memory next to the game image.
+struct builtin_keymap {
+    const char *name;
+    const uint8_t *map;
+} BuiltinKeymaps[] = {
+    {"jetpac", keymap_jetpac},
+    {"bombjack", keymap_bombjack},
+    {"thrust", keymap_thrust},
+    {"loderunner", keymap_loderunner},
+    {"ik", keymap_ik},
+    {"scuba", keymap_scuba},
+    {"bmxsim", keymap_bmxsim},
+    {"skooldaze", keymap_skooldaze},
+    {"sabre", keymap_sabre},
+    {"sanxion", keymap_sanxion},
+    {"3dshow_demo", keymap_3dshow_demo},
+};
+
+#define BuiltinKeymapsLen (sizeof(BuiltinKeymaps)/sizeof(BuiltinKeymaps[0]))
+
+// Return the builtin keymap for the game 'name' (case insensitive),
+// or the default keymap if there is none.
+const uint8_t *builtin_keymap_lookup(const char *name) {
+    for (size_t j = 0; j < BuiltinKeymapsLen; j++) {
+        if (!strcasecmp(BuiltinKeymaps[j].name,name))
+            return BuiltinKeymaps[j].map;
+    }
+    return keymap_default;
+}
@@ -0,0 +1,247 @@
+/* Keymaps format and key macros timeline.
+ *
+ * A keymap is an array of rows, three bytes each. The first byte of
+ * every row is a Pico pin (see the device configuration file) or one of
+ * the "virtual" pins defined below, and tells us how to interpret the
+ * other two bytes. The game keymaps themselves live in keymaps.h.
+ *
+ * Key macros (PRESS_AT_TICK / RELEASE_AT_TICK rows) are not scanned
+ * at every frame: when a game is loaded they are extracted from the
+ * keymap and sorted by frame into a timeline. At every frame we just
+ * check the next event of the timeline, so the cost is the same
+ * regardless of how long the scripted sequence is. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Kempston joystick key codes.
+#define KEMPSTONE_FIRE 0xff
+#define KEMPSTONE_LEFT 0xfe
+#define KEMPSTONE_RIGHT 0xfd
+#define KEMPSTONE_DOWN 0xfc
+#define KEMPSTONE_UP 0xfb
+
+// "Virtual" pins.
+//
+// PRESS_AT_TICK is specified when we want a key to be pressed
+// after the game starts, when a specific tick (frame) is reached.
+// This is often useful in order to select the joystick or for
+// similar tasks.
+//
+// Just specify PRESS_AT_TICK as pin, then the frame number, and
+// finally the key.
+//
+// A single byte only allows to reach frame 255. To fire macros later
+// than that, the row must be preceded by a MACRO_TICK_HI row holding
+// the high byte of the frame number. Don't write such rows by hand,
+// use the PRESS_AT() / RELEASE_AT() helpers below.
+#define PRESS_AT_TICK   0xfe // Press at the specified frame.
+#define RELEASE_AT_TICK 0xfd // Release at the specified frame.
+#define MACRO_TICK_HI   0xfc // Frame high byte of the next macro row.
+#define KEY_END         0xff // This just marks the end of the key map.
+
+// Press/release 'key' at any frame from 0 to 65535. Each helper expands
+// to two keymap rows.
+#define PRESS_AT(frame,key) \
+    MACRO_TICK_HI, (((frame)>>8)&0xff), 0, PRESS_AT_TICK, ((frame)&0xff), (key)
+#define RELEASE_AT(frame,key) \
+    MACRO_TICK_HI, (((frame)>>8)&0xff), 0, RELEASE_AT_TICK, ((frame)&0xff), (key)
+
+// Extended keymaps allow two device buttons (pins) to map to
+// other Specturm keys. This is useful for games such as Skool Daze
+// that have too many keys doing useful things, but where the nature
+// of the game don't make likely we press multiple keys for error.
+//
+// To use this kind of maps, xor KEY_EXT to the first pin, then
+// provide as second entry in the row the second pin, and finally
+// a single Spectrum key code to trigger.
+//
+// IMPORTANT: the extended key maps of a game must be the initial entries,
+// before the normal entries. This way we avoid also sensing the keys
+// mapped to the single buttons involved.
+#define KEY_EXT         0x80
+
+// Return true if the keymap row starting at 'row' is a macro related
+// row, and not a pin mapping.
+#define kmap_is_macro_row(row) \
+    ((row)[0] == PRESS_AT_TICK || \
+     (row)[0] == RELEASE_AT_TICK || \
+     (row)[0] == MACRO_TICK_HI)
+
+/* ============================ Macros timeline ============================= */
+
+#define KMAP_MAX_MACROS 64 // Max press/release events per keymap.
+
+struct kmap_macro {
+    uint16_t tick;      // Frame at which the event fires.
+    uint8_t key;        // Spectrum key code.
+    uint8_t press;      // 1 = press, 0 = release.
+};
+
+typedef struct {
+    struct kmap_macro event[KMAP_MAX_MACROS]; // Sorted by tick.
+    uint32_t count;     // Number of events in the timeline.
+    uint32_t next;      // Index of the next event to fire.
+} kmap_timeline_t;
+
+// Populate the timeline 'tl' with the macros of 'keymap', sorted by
+// frame. Events with the same frame keep the keymap order. Returns the
+// number of events that did not fit in the timeline, so 0 on success.
+int kmap_timeline_build(kmap_timeline_t *tl, const uint8_t *keymap) {
+    int dropped = 0;
+    uint16_t tick_hi = 0;
+
+    tl->count = 0;
+    tl->next = 0;
+    for (int j = 0; keymap[j] != KEY_END; j += 3) {
+        if (keymap[j] == MACRO_TICK_HI) {
+            tick_hi = keymap[j+1];
+            continue;
+        }
+        if (keymap[j] != PRESS_AT_TICK && keymap[j] != RELEASE_AT_TICK)
+            continue;
+
+        struct kmap_macro m = {
+            .tick = (tick_hi<<8) | keymap[j+1],
+            .key = keymap[j+2],
+            .press = keymap[j] == PRESS_AT_TICK
+        };
+        tick_hi = 0; // MACRO_TICK_HI only applies to the next row.
+
+        if (tl->count == KMAP_MAX_MACROS) {
+            dropped++;
+            continue;
+        }
+
+        // Insertion sort: keymaps are tiny and usually already sorted,
+        // so this is almost always a simple append.
+        int i = tl->count++;
+        while (i > 0 && tl->event[i-1].tick > m.tick) {
+            tl->event[i] = tl->event[i-1];
+            i--;
+        }
+        tl->event[i] = m;
+    }
+    return dropped;
+}
+
+// Fire all the events scheduled up to frame 'tick'. Since the timeline
+// is sorted, when nothing is due this is a single comparison.
+void kmap_timeline_run(kmap_timeline_t *tl, zx_t *zx, uint32_t tick) {
+    while (tl->next < tl->count && tl->event[tl->next].tick <= tick) {
+        struct kmap_macro *m = tl->event+tl->next;
+        if (m->press)
+            zx_key_down(zx,m->key);
+        else
+            zx_key_up(zx,m->key);
+        tl->next++;
+    }
+}
+
+/* ============================ Keymaps in flash ============================
+ * Keymaps can also be stored in the flash memory, next to each game,
+ * so that games can be added without recompiling the emulator (see
+ * games/kmap.py, that compiles the text keymaps). In flash keymaps
+ * buttons are not Pico pins, that depend on the device, but the
+ * logical buttons KMAP_BTN_*, translated to pins when loading.
+ *
+ * Binary format:
+ *
+ *   'K' 'M' <version> <number of rows, KEY_END row included>
+ *   <rows>...
+ *
+ * The keymap is checked and translated once, when the game is loaded,
+ * into the same representation of the keymaps in keymaps.h. A map
+ * that is not valid is rejected as a whole, so the per-frame input
+ * handling never sees malformed rows. */
+
+#define KMAP_VERSION 1
+#define KMAP_HDR_LEN 4
+#define KMAP_MAX_ROWS 64 // Rows in the binary keymap, KEY_END included.
+
+// Logical buttons.
+#define KMAP_BTN_LEFT   0
+#define KMAP_BTN_RIGHT  1
+#define KMAP_BTN_FIRE   2
+#define KMAP_BTN_UP     3
+#define KMAP_BTN_DOWN   4
+#define KMAP_BTN_COUNT  5
+
+// Return true if 'code' is a key code the Spectrum keyboard or the
+// Kempston joystick emulation understands (see zx.h keyboard matrix).
+int kmap_valid_key(uint8_t code) {
+    if (code >= 0x20 && code <= 0x7e) return 1;  // Printable ASCII.
+    if (code >= 0x07 && code <= 0x0f) return 1;  // Edit, cursor, ...
+    if (code >= KEMPSTONE_UP) return 1;          // Kempston joystick.
+    return 0;
+}
+
+// Validate the binary keymap 'src' of 'srclen' bytes and translate it
+// into 'dst', that must have room for KMAP_MAX_ROWS*3 bytes. 'pins' maps
+// each KMAP_BTN_* to the device pin. On success 0 is returned, otherwise
+// -1 is returned and 'err' set to a static string describing the problem.
+int kmap_load(uint8_t *dst, const uint8_t *src, size_t srclen,
+              const uint8_t *pins, const char **err)
+{
+    *err = NULL;
+    if (srclen < KMAP_HDR_LEN || src[0] != 'K' || src[1] != 'M') {
+        *err = "not a keymap";
+    } else if (src[2] != KMAP_VERSION) {
+        *err = "unsupported keymap version";
+    } else if (src[3] == 0) {
+        *err = "no rows";
+    } else if (src[3] > KMAP_MAX_ROWS) {
+        *err = "too many rows";
+    } else if (srclen != KMAP_HDR_LEN + (size_t)src[3]*3) {
+        *err = "length mismatch";
+    }
+    if (*err) return -1;
+
+    uint32_t rows = src[3];
+    uint32_t macros = 0;
+    int normal_seen = 0;    // Extended maps must come first.
+    src += KMAP_HDR_LEN;
+    for (uint32_t r = 0; r < rows; r++) {
+        const uint8_t *row = src+r*3;
+        uint8_t *out = dst+r*3;
+        uint8_t btn = row[0] & ~KEY_EXT;
+        out[0] = row[0]; out[1] = row[1]; out[2] = row[2];
+
+        if (row[0] == KEY_END) {
+            if (r == rows-1) return 0;
+            *err = "KEY_END before the last row";
+        } else if (row[0] == MACRO_TICK_HI) {
+            if (r+1 >= rows || (src[(r+1)*3] != PRESS_AT_TICK &&
+                                src[(r+1)*3] != RELEASE_AT_TICK))
+                *err = "MACRO_TICK_HI not followed by a macro";
+        } else if (row[0] == PRESS_AT_TICK || row[0] == RELEASE_AT_TICK) {
+            if (!kmap_valid_key(row[2]) || row[2] == 0)
+                *err = "invalid macro key";
+            else if (++macros > KMAP_MAX_MACROS)
+                *err = "too many macros";
+        } else if (btn >= KMAP_BTN_COUNT) {
+            *err = "invalid button";
+        } else if (row[0] & KEY_EXT) {
+            if (normal_seen)
+                *err = "extended map after normal maps";
+            else if (row[1] >= KMAP_BTN_COUNT || row[1] == btn)
+                *err = "invalid extended map button";
+            else if (!kmap_valid_key(row[2]) || row[2] == 0)
+                *err = "invalid key";
+            else {
+                out[0] = pins[btn] | KEY_EXT;
+                out[1] = pins[row[1]];
+            }
+        } else {
+            normal_seen = 1;
+            if ((row[1] && !kmap_valid_key(row[1])) ||
+                (row[2] && !kmap_valid_key(row[2])))
+                *err = "invalid key";
+            else
+                out[0] = pins[btn];
+        }
+        if (*err) return -1;
+    }
+    *err = "missing KEY_END";
+    return -1;
+}
@@ -0,0 +1,100 @@
+/* Performance counters.
+ *
+ * Durations are accumulated into fixed slots, and printed, averaged per
+ * frame, once every PERF_REPORT_USEC microseconds, or on demand. The
+ * values of the last frame alone are also available, for telemetry.h.
+ * This way the emulator main loop does no formatting at all, and the
+ * cost of a measure is a couple of register reads and an addition.
+ *
+ * Two clocks are used: short sections (the zx.h subsystems, the display
+ * lines) are measured in CPU cycles with the SysTick timer, that is only
+ * 24 bits, so can't measure anything longer than 2^24 cycles (40ms at
+ * 400Mhz). Long sections (a full frame, zx_exec()) are measured in
+ * microseconds with the system timer. */
+
+#include "hardware/structs/systick.h"
+#include "hardware/timer.h"
+#include "hardware/clocks.h"
+
+// Slots. The first ones are the zx.h profiling hooks subsystems, with
+// the same numbers, so that ZX_PROFILE_BEGIN() can use them directly.
+#define PERF_DECODE     0   // Video scanlines decoding (cycles).
+#define PERF_AUDIO      1   // Beeper sampling (cycles).
+#define PERF_KBD        2   // Spectrum keyboard matrix (cycles).
+#define PERF_KEYS       3   // Device buttons -> Spectrum keys (cycles).
+#define PERF_CONVERT    4   // Framebuffer -> RGB565 lines (cycles).
+#define PERF_XFER       5   // Lines transfer to the display (cycles).
+#define PERF_EXEC       6   // Whole zx_exec(), subsystems included (us).
+#define PERF_FRAME      7   // Whole main loop iteration (us).
+#define PERF_SLOTS      8
+#define PERF_FIRST_US_SLOT PERF_EXEC
+
+#define PERF_REPORT_USEC 1000000
+
+static struct {
+    uint32_t start[PERF_SLOTS]; // Start time of the running measure.
+    uint64_t total[PERF_SLOTS]; // Accumulated cycles / microseconds.
+    uint64_t mark[PERF_SLOTS];  // Totals at the end of the last frame.
+    uint32_t frame[PERF_SLOTS]; // Values of the last frame alone.
+    uint32_t frames;            // Frames since last report.
+    uint32_t last_report;       // time_us_32() of the last report.
+} Perf;
+
+// Start the SysTick timer, free running at the CPU clock.
+void perf_init(void) {
+    systick_hw->rvr = 0x00ffffff;
+    systick_hw->cvr = 0;
+    systick_hw->csr = 0x5;  // Enable, source = processor clock.
+    Perf.last_report = time_us_32();
+}
+
+// SysTick counts down, so the elapsed cycles are start-end.
+#define perf_cycles_begin(slot) (Perf.start[slot] = systick_hw->cvr)
+#define perf_cycles_end(slot) \
+    (Perf.total[slot] += (Perf.start[slot]-systick_hw->cvr) & 0x00ffffff)
+#define perf_us_begin(slot) (Perf.start[slot] = time_us_32())
+#define perf_us_end(slot) \
+    (Perf.total[slot] += time_us_32()-Perf.start[slot])
+
+// Print the counters averaged per frame, and reset them.
+void perf_report(void) {
+    static const char *names[PERF_SLOTS] = {
+        "decode","audio","kbd","keys","convert","xfer","exec","frame"
+    };
+    uint32_t now = time_us_32();
+    uint32_t frames = Perf.frames ? Perf.frames : 1;
+    uint32_t mhz = clock_get_hz(clk_sys)/1000000;
+    uint32_t avg[PERF_SLOTS];
+
+    for (int j = 0; j < PERF_SLOTS; j++) {
+        uint64_t t = Perf.total[j];
+        if (j < PERF_FIRST_US_SLOT) t /= mhz;   // Cycles -> us.
+        avg[j] = t/frames;
+        Perf.total[j] = 0;
+        Perf.mark[j] = 0;
+    }
+
+    // Z80 emulation is what zx_exec() did outside the subsystems.
+    uint32_t sub = avg[PERF_DECODE]+avg[PERF_AUDIO]+avg[PERF_KBD];
+    uint32_t z80 = avg[PERF_EXEC] > sub ? avg[PERF_EXEC]-sub : 0;
+    printf("[perf] %lu frames in %lu ms @%lu Mhz, us/frame: z80 %lu",
+        (unsigned long)Perf.frames,
+        (unsigned long)(now-Perf.last_report)/1000,
+        (unsigned long)mhz, (unsigned long)z80);
+    for (int j = 0; j < PERF_SLOTS; j++)
+        printf(" %s %lu", names[j], (unsigned long)avg[j]);
+    printf("\n");
+    Perf.frames = 0;
+    Perf.last_report = now;
+}
+
+// Called once per frame: computes the values of the frame just ended,
+// in Perf.frame[]. Returns true if it's time to print the report.
+int perf_frame_done(void) {
+    Perf.frames++;
+    for (int j = 0; j < PERF_SLOTS; j++) {
+        Perf.frame[j] = Perf.total[j]-Perf.mark[j];
+        Perf.mark[j] = Perf.total[j];
+    }
+    return time_us_32()-Perf.last_report >= PERF_REPORT_USEC;
+}
@@ -392,7 +392,7 @@ void st77xx_fill_box(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint16_t c)
 
     // Prefill buffer.
     if (left < buflen) buflen = left;
-    for (int j = 0; j < buflen; j++) buf[j] = c;
+    for (unsigned int j = 0; j < buflen; j++) buf[j] = c;
 
     // Transfer buffer-length data at time until we can.
     st77xx_setwin(x,y,x+w-1,y+h-1);
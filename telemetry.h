@@ -0,0 +1,121 @@
+/* Binary telemetry over USB CDC.
+ *
+ * When enabled (sending 't' on the USB serial toggles it), a record is
+ * produced at every frame with the timings of perf.h and other emulator
+ * state, and appended to a small ring buffer. The ring is drained from
+ * the main loop, writing only as many records as the USB CDC transmit
+ * buffer can take without blocking: if the host does not read fast
+ * enough, the ring fills and new records are dropped. The sequence
+ * number of the records makes the drops visible to the host.
+ *
+ * The stream shares the serial with printf() output, so every record
+ * is framed with a two bytes magic and a checksum, and the host decoder
+ * (host/telemetry.py) skips whatever is between valid records.
+ *
+ * Records are written through the stdio layer, like printf(), and not
+ * with tud_cdc_write(): stdio_usb runs the TinyUSB task in the
+ * background, holding its own mutex that we can't take, and writing to
+ * the CDC directly would race with it. stdio_put_string() serializes
+ * with printf() too, without the CR/LF translation. Its USB driver
+ * blocks when the CDC buffer is full, so no more than the free space
+ * is written at every call.
+ *
+ * Record format, all little endian:
+ *
+ *   'Z' 'T' <type:u8> <payload len:u8> <seq:u16> <payload> <fletcher16:u16>
+ *
+ * The checksum covers everything from the type to the end of the
+ * payload. */
+
+#include <stddef.h>
+#include "pico/stdio.h"
+#include "tusb.h"
+
+#define TELEMETRY_TYPE_FRAME 1
+#define TELEMETRY_RING_LEN 16   // Records. Must be a power of two.
+
+// Payload of the TELEMETRY_TYPE_FRAME record. Must match the decoder.
+struct __attribute__((packed)) telemetry_frame {
+    uint32_t tick;              // Frame number since the game was loaded.
+    uint32_t tstates;           // T-states emulated in this frame.
+    uint32_t clock_khz;         // System clock.
+    uint32_t display_bytes;     // Bytes sent to the display.
+    uint32_t perf[PERF_SLOTS];  // perf.h values of this frame.
+    uint16_t audio_pos;         // Audio buffer write position, in samples.
+    uint16_t audio_wait;        // Playback delay between samples.
+    uint8_t audio_notify;       // Audio buffer half ready to play, or 0.
+    uint8_t menu_active;        // Menu shown.
+};
+
+struct __attribute__((packed)) telemetry_record {
+    uint8_t magic[2];
+    uint8_t type;
+    uint8_t len;
+    uint16_t seq;
+    struct telemetry_frame frame;
+    uint16_t checksum;
+};
+
+static struct {
+    int enabled;
+    uint16_t seq;               // Sequence number of the next record.
+    uint32_t head, tail;        // Ring write / read positions.
+    uint32_t sent;              // Bytes of the tail record already sent.
+    struct telemetry_record ring[TELEMETRY_RING_LEN];
+} Telemetry;
+
+void telemetry_enable(int enable) {
+    Telemetry.enabled = enable;
+    Telemetry.head = Telemetry.tail = Telemetry.sent = 0;
+}
+
+static uint16_t telemetry_fletcher16(const uint8_t *p, size_t len) {
+    uint32_t a = 0, b = 0;
+    while (len--) {
+        a = (a + *p++) % 255;
+        b = (b + a) % 255;
+    }
+    return (b << 8) | a;
+}
+
+// Append a frame record to the ring. If the ring is full the record is
+// dropped, but its sequence number is consumed anyway.
+void telemetry_push_frame(struct telemetry_frame *frame) {
+    uint16_t seq = Telemetry.seq++;
+    if (Telemetry.head-Telemetry.tail == TELEMETRY_RING_LEN) return;
+
+    struct telemetry_record *r =
+        Telemetry.ring+(Telemetry.head & (TELEMETRY_RING_LEN-1));
+    r->magic[0] = 'Z';
+    r->magic[1] = 'T';
+    r->type = TELEMETRY_TYPE_FRAME;
+    r->len = sizeof(*frame);
+    r->seq = seq;
+    r->frame = *frame;
+    r->checksum = telemetry_fletcher16(&r->type,
+        offsetof(struct telemetry_record,checksum)-2);
+    Telemetry.head++;
+}
+
+// Send as much of the ring as the USB CDC can take right now. Never
+// blocks: a record may be sent in multiple calls. The free space is read
+// without the stdio_usb mutex, but the background task only makes more
+// room.
+void telemetry_drain(void) {
+    if (!tud_cdc_connected()) return;
+    while (Telemetry.tail != Telemetry.head) {
+        uint32_t avail = tud_cdc_write_available();
+        if (avail == 0) break;
+
+        uint8_t *r = (uint8_t*)
+            (Telemetry.ring+(Telemetry.tail & (TELEMETRY_RING_LEN-1)));
+        uint32_t left = sizeof(struct telemetry_record)-Telemetry.sent;
+        uint32_t len = left < avail ? left : avail;
+        stdio_put_string((const char*)r+Telemetry.sent,len,false,false);
+        Telemetry.sent += len;
+        if (Telemetry.sent == sizeof(struct telemetry_record)) {
+            Telemetry.sent = 0;
+            Telemetry.tail++;
+        }
+    }
+}
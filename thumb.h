@@ -0,0 +1,44 @@
+/* Game thumbnails format.
+ *
+ * games/loadgames.py stores, next to each game in the flash image, a
+ * thumbnail of its screen after a few seconds of play (see the host tool
+ * host/zxthumb.c), so that the menu can show a preview of the selected
+ * game without loading it.
+ *
+ * A thumbnail is the 256x192 Spectrum screen, border excluded, scaled
+ * down 4 times: 64x48 pixels, 4bpp like the emulator framebuffer (high
+ * nibble = left pixel), THUMB_BYTES bytes, no header. */
+
+#include <stdint.h>
+#include <string.h>
+
+#define THUMB_SCALE 4
+#define THUMB_W (256/THUMB_SCALE)
+#define THUMB_H (192/THUMB_SCALE)
+#define THUMB_BYTES (THUMB_W/2*THUMB_H)
+
+// Scale down the screen in the framebuffer 'fb' (4bpp, 160 bytes per
+// line, 32 pixels of border on every side) into 'thumb'. Every
+// thumbnail pixel gets the most used color of its 4x4 pixels block, so
+// that thin lines and text on a plain background are not lost. Bright
+// black (8) is the same as black, and is stored as black (0): the menu
+// draws through overlays where 8 is the transparent color.
+void thumb_from_fb(const uint8_t *fb, uint8_t *thumb) {
+    memset(thumb,0,THUMB_BYTES);
+    for (int ty = 0; ty < THUMB_H; ty++) {
+        for (int tx = 0; tx < THUMB_W; tx++) {
+            uint8_t count[16] = {0};
+            int best = 0;
+            for (int y = 0; y < THUMB_SCALE; y++) {
+                const uint8_t *line = fb + (32+ty*THUMB_SCALE+y)*160;
+                for (int x = 0; x < THUMB_SCALE; x++) {
+                    int px = 32+tx*THUMB_SCALE+x;
+                    int c = (px&1) ? line[px>>1]&0xf : line[px>>1]>>4;
+                    if (c == 8) c = 0;
+                    if (++count[c] > count[best]) best = c;
+                }
+            }
+            thumb[ty*(THUMB_W/2)+tx/2] |= (tx&1) ? best : best<<4;
+        }
+    }
+}
@@ -333,6 +333,20 @@ extern "C" {
 #define Z80_ZF (1<<6)           // zero
 #define Z80_SF (1<<7)           // sign
 
+// Execution trace. With Z80_TRACE_LEN set to a power of 2, trace[] is
+// a ring buffer of the PCs of the last Z80_TRACE_LEN instructions, and
+// of the interrupts taken (the return address, flagged Z80_TRACE_INT or
+// Z80_TRACE_NMI). trace_pos counts the entries ever written, so the
+// oldest one is at trace_pos & (Z80_TRACE_LEN-1). Updated by the opcode
+// fetch with one store and one increment. While the CPU is halted, the
+// HALT fetched again and again is stored in the next slot but not
+// counted: the oldest entry may be a copy of it.
+#ifndef Z80_TRACE_LEN
+#define Z80_TRACE_LEN 0
+#endif
+#define Z80_TRACE_INT (1<<16)
+#define Z80_TRACE_NMI (1<<17)
+
 // CPU state
 typedef struct {
     uint16_t step;      // the currently active decoder step
@@ -363,6 +377,10 @@ typedef struct {
     uint16_t af2, bc2, de2, hl2; // shadow register bank
     uint8_t im;
     bool iff1, iff2;
+#if Z80_TRACE_LEN
+    uint32_t trace_pos;
+    uint32_t trace[Z80_TRACE_LEN];
+#endif
 } z80_t;
 
 // initialize a new Z80 instance and return initial pin mask
@@ -1690,6 +1708,15 @@ static inline uint64_t _z80_refresh(z80_t* cpu, uint64_t pins) {
     return pins;
 }
 
+// add 'entry' to the execution trace, see Z80_TRACE_LEN
+#if Z80_TRACE_LEN
+#define _z80_trace(cpu,entry,pins) { \
+    (cpu)->trace[(cpu)->trace_pos & (Z80_TRACE_LEN-1)] = (entry); \
+    (cpu)->trace_pos += !((pins) & Z80_HALT); }
+#else
+#define _z80_trace(cpu,entry,pins)
+#endif
+
 // initiate a fetch machine cycle for regular (non-prefixed) instructions, or initiate interrupt handling
 static inline uint64_t _z80_fetch(z80_t* cpu, uint64_t pins) {
     cpu->hlx_idx = 0;
@@ -1697,6 +1724,7 @@ static inline uint64_t _z80_fetch(z80_t* cpu, uint64_t pins) {
     // shortcut no interrupts requested
     if (cpu->int_bits == 0) {
         cpu->step = 0xFFFF;
+        _z80_trace(cpu, cpu->pc, pins);
         return _z80_set_ab_x(pins, cpu->pc++, Z80_M1|Z80_MREQ|Z80_RD);
     }
     else if (cpu->int_bits & Z80_NMI) {
@@ -1707,6 +1735,7 @@ static inline uint64_t _z80_fetch(z80_t* cpu, uint64_t pins) {
             pins &= ~Z80_HALT;
             cpu->pc++;
         }
+        _z80_trace(cpu, cpu->pc | Z80_TRACE_NMI, pins);
         // NOTE: PC is *not* incremented!
         return _z80_set_ab_x(pins, cpu->pc, Z80_M1|Z80_MREQ|Z80_RD);
     }
@@ -1722,12 +1751,14 @@ static inline uint64_t _z80_fetch(z80_t* cpu, uint64_t pins) {
                 pins &= ~Z80_HALT;
                 cpu->pc++;
             }
+            _z80_trace(cpu, cpu->pc | Z80_TRACE_INT, pins);
             // NOTE: PC is not incremented, and no pins are activated here
             return pins;
         }
         else {
             // oops, maskable interrupt requested but disabled
             cpu->step = 0xFFFF;
+            _z80_trace(cpu, cpu->pc, pins);
             return _z80_set_ab_x(pins, cpu->pc++, Z80_M1|Z80_MREQ|Z80_RD);
         }
     }
@@ -1812,6 +1843,10 @@ uint64_t z80_prefetch(z80_t* cpu, uint16_t new_pc) {
 #define _cc_p           (!(cpu->f&Z80_SF))
 #define _cc_m           (cpu->f&Z80_SF)
 
+// The Pico port glues consecutive steps of the decoder letting the cases
+// fall through on purpose (see the 'speedup' steps).
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wimplicit-fallthrough"
 uint64_t z80_tick(z80_t* cpu, mem_t *mem, uint64_t pins) {
 switch_again:
     pins &= ~(Z80_CTRL_PIN_MASK|Z80_RETI);
@@ -4806,21 +4841,14 @@ step_next_and_iterate: cpu->step += 1;
         cpu->int_bits = ((cpu->int_bits | rising_nmi) & Z80_NMI) | (pins & Z80_INT);
     }
 
-    if (pins & (Z80_INT|Z80_MREQ|Z80_IORQ)) {
-        if ((pins & Z80_INT|Z80_MREQ|Z80_IORQ) == Z80_MREQ) {
-            const uint16_t addr = Z80_GET_ADDR(pins);
-            if (pins & Z80_RD) {
-                Z80_SET_DATA(pins, mem_rd(mem, addr));
-            }
-            else if (pins & Z80_WR) {
-                mem_wr(mem, addr, Z80_GET_DATA(pins));
-            }
-        } else {
-            return pins;
-        }
-    }
+    // Interrupts, memory and I/O requests all return to the caller, that
+    // serves the requests (zx_exec() also checks the debugger watchpoints
+    // there), so 'mem' is not accessed here.
+    (void)mem;
+    if (pins & (Z80_INT|Z80_MREQ|Z80_IORQ)) return pins;
     goto switch_again;
 }
+#pragma GCC diagnostic pop
 
 #undef _sa
 #undef _sax
@@ -3,13 +3,36 @@
  * See the LICENSE file for more info. */
 
 #include <stdio.h>
+#include <strings.h>
 #include "pico/stdlib.h"
 #include "pico/multicore.h"
+#include "pico/stdio_usb.h"
 #include "hardware/vreg.h"
-
-#include "device_config.h" // Hardware-specific defines for ST77 and keys.
+#include "hardware/watchdog.h"
+
+// Hardware-specific defines for ST77 and keys. The host benchmarks
+// select their own configuration with ZX_DEVICE_CONFIG.
+#ifdef ZX_DEVICE_CONFIG
+#include ZX_DEVICE_CONFIG
+#else
+#include "device_config.h"
+#endif
 #include "st77xx.h"
-#include "keymaps.h"
+#include "perf.h"
+#include "telemetry.h"
+
+// Feed the zx.h subsystems timings into the performance counters. The
+// hooks read the SysTick timer at every scanline and every audio sample,
+// so normal builds just measure zx_exec() as a whole: benchmark builds
+// define ZX_PERF_SUBSYSTEMS to 1 (cmake -DZX_PERF_SUBSYSTEMS=ON) to get
+// the video decoding, audio and keyboard times too.
+#ifndef ZX_PERF_SUBSYSTEMS
+#define ZX_PERF_SUBSYSTEMS 0
+#endif
+#if ZX_PERF_SUBSYSTEMS
+#define ZX_PROFILE_BEGIN(what) perf_cycles_begin(what)
+#define ZX_PROFILE_END(what) perf_cycles_end(what)
+#endif
 
 #define CHIPS_IMPL
 #include "chips_common.h"
@@ -18,7 +41,16 @@
 #include "kbd.h"
 #include "clk.h"
 #include "zx.h"
+
+// The ROM is only read by zx_init(), that copies it into the emulator
+// state, so the image is left in flash instead of taking 16k of RAM.
+#define dump_amstrad_zx48k_bin __in_flash("zx_roms") dump_amstrad_zx48k_bin
 #include "zx-roms.h"
+#undef dump_amstrad_zx48k_bin
+#include "kmap.h"
+#include "keymaps.h"
+#include "thumb.h"
+#include "fb4.h"
 
 #define DEBUG_MODE 1
 
@@ -43,11 +75,124 @@ static uint32_t zxpalette[16] = {
 };
 
 void load_game(int game_id);
+void hud_show(int show);
+void trace_dump_current(void);
+void watchdog_heartbeat(int core, uint32_t frames);
+void watchdog_report(void);
 
 /* =============================== Games list =============================== */
 
-#include "games/games_list.h"
-#define GamesTableSize (sizeof(GamesTable)/sizeof(GamesTable[0]))
+/* Games and their keymaps are stored in the flash memory by the
+ * games/loadgames.py script, and are not compiled into the emulator.
+ * The image starts with a small catalog:
+ *
+ *   Header:  "ZXGC" <u16 version> <u16 entry size> <u32 count>
+ *            <u32 image size>
+ *   Entries: <name[16]> <u32 game offset> <u32 game size>
+ *            <u32 keymap offset> <u32 keymap size>
+ *            <u32 thumbnail offset> <u32 thumbnail size>
+ *
+ * All the numbers are little endian, and offsets are relative to the
+ * start of the image. A keymap size of zero means the game has no
+ * keymap in flash and uses the builtin one (see keymaps.h). Thumbnails
+ * (see thumb.h) are optional too, and older images have 32 bytes entries
+ * without them, and 0 as image size. Every entry is checked against the
+ * image size, or the end of the flash for older images: an entry pointing
+ * outside is skipped, so a corrupted catalog can't make the emulator
+ * read past the flash. */
+
+#define GAMES_FLASH_ADDR 0x1007f100 // Must match games/loadgames.py.
+#ifndef PICO_FLASH_SIZE_BYTES
+#define PICO_FLASH_SIZE_BYTES (2*1024*1024)
+#endif
+// Max size of the image: from GAMES_FLASH_ADDR to the end of the flash.
+#define GAMES_FLASH_MAX_LEN (0x10000000+PICO_FLASH_SIZE_BYTES-GAMES_FLASH_ADDR)
+#define GAMES_MAX 64
+#define GAMES_CATALOG_VERSION 1
+#define GAMES_CATALOG_HDR_LEN 16
+#define GAMES_CATALOG_ENTRY_LEN 32  // Minimum entry size we understand.
+#define GAMES_CATALOG_THUMB_LEN 40  // Entry size with the thumbnail.
+
+struct game_entry {
+    char name[16];
+    const uint8_t *addr;    // Address in the flash memory.
+    size_t size;            // Length in bytes.
+    const uint8_t *map;     // Binary keymap in flash, or NULL.
+    size_t map_size;        // Binary keymap length in bytes.
+    const uint8_t *thumb;   // THUMB_BYTES thumbnail in flash, or NULL.
+} GamesTable[GAMES_MAX];
+uint32_t GamesTableSize = 0;
+
+static uint32_t catalog_u32(const uint8_t *p) {
+    return p[0] | (p[1]<<8) | (p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+
+static uint16_t catalog_u16(const uint8_t *p) {
+    return p[0] | (p[1]<<8);
+}
+
+// Return true if 'size' bytes at 'offset' are inside an image of 'len'
+// bytes.
+static int catalog_in_image(uint32_t offset, uint32_t size, uint32_t len) {
+    return offset <= len && size <= len-offset;
+}
+
+// Populate GamesTable from the catalog in the flash memory, that can't
+// extend beyond 'max_len' bytes. Must be called at a clock where the
+// flash can be accessed. Returns the number of games found: zero if the
+// catalog is missing or corrupted.
+uint32_t games_catalog_load(const uint8_t *image, uint32_t max_len) {
+    GamesTableSize = 0;
+    if (memcmp(image,"ZXGC",4) != 0 ||
+        catalog_u16(image+4) != GAMES_CATALOG_VERSION)
+    {
+        printf("No games catalog found in flash at %p\n", image);
+        return 0;
+    }
+
+    uint32_t entry_len = catalog_u16(image+6);
+    uint32_t count = catalog_u32(image+8);
+    uint32_t len = catalog_u32(image+12);
+    if (len == 0) len = max_len; // Older image without its size.
+    if (entry_len < GAMES_CATALOG_ENTRY_LEN || len > max_len ||
+        !catalog_in_image(GAMES_CATALOG_HDR_LEN,0,len) ||
+        count > (len-GAMES_CATALOG_HDR_LEN)/entry_len)
+    {
+        printf("Games catalog in flash is corrupted\n");
+        return 0;
+    }
+    if (count > GAMES_MAX) {
+        printf("Too many games in flash, only %d loaded\n", GAMES_MAX);
+        count = GAMES_MAX;
+    }
+
+    const uint8_t *e = image+GAMES_CATALOG_HDR_LEN;
+    for (uint32_t j = 0; j < count; j++, e += entry_len) {
+        struct game_entry *g = GamesTable+GamesTableSize;
+        uint32_t addr = catalog_u32(e+16), size = catalog_u32(e+20);
+        uint32_t map = catalog_u32(e+24), map_size = catalog_u32(e+28);
+        memcpy(g->name,e,sizeof(g->name));
+        g->name[sizeof(g->name)-1] = 0;
+        if (size == 0 || !catalog_in_image(addr,size,len) ||
+            (map_size && !catalog_in_image(map,map_size,len)))
+        {
+            printf("Game %u (%s) is outside the games image, skipped\n",
+                (unsigned)j, g->name);
+            continue;
+        }
+        g->addr = image+addr;
+        g->size = size;
+        g->map_size = map_size;
+        g->map = map_size ? image+map : NULL;
+        g->thumb = NULL;
+        if (entry_len >= GAMES_CATALOG_THUMB_LEN &&
+            catalog_u32(e+36) == THUMB_BYTES &&
+            catalog_in_image(catalog_u32(e+32),THUMB_BYTES,len))
+            g->thumb = image+catalog_u32(e+32);
+        GamesTableSize++;
+    }
+    return GamesTableSize;
+}
 
 /* ========================== Global state and defines ====================== */
 
@@ -55,10 +200,16 @@ void load_game(int game_id);
 // is modified to glue together the instruction fetch steps, so we do
 // more work per tick.
 #define FRAME_USEC (25000)
+#define ZX_CPU_HZ 3500000   // Real Spectrum 48k Z80 clock, for speed reports.
 
+// The device front-end state. There is a single instance of it, and the
+// UI, input and display code use it directly: only the emulator core
+// (zx_t and the z80.h / zx.h functions) supports multiple instances,
+// like host/zxbatch.c does.
 static struct emustate {
     zx_t zx;    // The emulator state.
     int debug;  // Debugging mode
+    int benchmark; // Run the benchmark at startup, see run_benchmark().
 
     // We switch betweent wo clocks: one is selected just for zx_exec(), that
     // is the most speed critical code path. For all the other code execution
@@ -71,10 +222,16 @@ static struct emustate {
 
     // Keymap in use right now. Modified by load_game().
     const uint8_t *current_keymap;
+    kmap_timeline_t macros;     // Key macros of the current keymap.
+    uint8_t keymap_buf[KMAP_MAX_ROWS*3]; // Keymap loaded from flash.
 
     // Is the game selection / config menu shown?
     int menu_active;
     uint32_t menu_left_at_tick; // EMU.tick when the menu was closed.
+    absolute_time_t last_key_accepted_time; // For menu keys debouncing.
+    int left_right_frames;      // Frames left+right have been held down.
+    int up_down_frames;         // Frames up+down have been held down.
+    int hud_active;             // Is the performance HUD shown?
     int selected_game;          // Game index of currently selected game in
                                 // the UI. If less than 0 a settings item is
                                 // selected instead.
@@ -86,10 +243,16 @@ static struct emustate {
     uint32_t volume;            // Audio volume. Controls PWM value.
     volatile uint32_t audio_sample_wait; // Wait time (in busy loop cycles)
                                          // between samples when playing back.
+    volatile uint32_t audio_underruns;   // Times playback waited for data.
 
     // All our UI graphic primitives are automatically cropped
     // to the area selected by ui_set_crop_area().
     uint16_t ui_crop_x1, ui_crop_x2, ui_crop_y1, ui_crop_y2;
+
+    // Drawing target of the UI primitives: an overlay, or the Spectrum
+    // framebuffer if NULL. See ui_set_target().
+    struct ui_overlay *ui_target;
+    int menu_redraw;            // Draw the whole menu again.
 } EMU;
 
 /* ========================== Emulator user interface ======================= */
@@ -203,59 +366,158 @@ void ui_set_crop_area(uint16_t x1, uint16_t x2, uint16_t y1, uint16_t y2) {
     EMU.ui_crop_y2 = y2;
 }
 
-// Allow to draw everywhere on the screen. Called after we finished
-// updating a specific area to restore the normal state.
+/* =============================== UI overlays ==============================
+ * The menu is not drawn into the Spectrum framebuffer, that the ULA
+ * rewrites at every frame, but into an overlay: a 4bpp surface covering
+ * a rectangle of the framebuffer, that update_display() merges while
+ * converting the lines. Overlay pixels set to UI_TRANSPARENT show the
+ * emulated screen below. This way the menu is drawn again only when its
+ * content changes, and the game picture is never touched. */
+
+#define UI_TRANSPARENT 8    // Bright black: same as black, never needed.
+
+struct ui_overlay {
+    uint16_t x, y;          // Top-left corner in the framebuffer, x even.
+    uint16_t width, height; // Size in pixels, width even.
+    uint8_t *buf;           // width/2 bytes per line, 4bpp.
+    int visible;            // Merged by update_display() only if true.
+};
+
+// Menu geometry, in framebuffer coordinates: the right / top part of
+// the screen, 2/3 of the height, rounded to the 2x font size, plus the
+// vertical padding.
+#define UI_MENU_X (st77_width/2)
+#define UI_MENU_Y 32            // Skip border in case it's not displayed.
+#define UI_MENU_W (st77_width/2-5)
+#define UI_MENU_VPAD 2          // Vertical padding of text inside the box.
+#define UI_MENU_H (st77_height/3*2 - ((st77_height/3*2)&15) + UI_MENU_VPAD*2)
+#define UI_MENU_OVERLAY_W ((UI_MENU_W+1)&~1)
+
+static uint8_t UIMenuBuf[UI_MENU_OVERLAY_W/2*UI_MENU_H];
+struct ui_overlay UIMenuOverlay = {
+    UI_MENU_X, UI_MENU_Y, UI_MENU_OVERLAY_W, UI_MENU_H, UIMenuBuf, 0
+};
+
+// Thumbnail of the selected game, left of the menu, with a frame.
+#define UI_THUMB_OVERLAY_W (THUMB_W+4)
+#define UI_THUMB_OVERLAY_H (THUMB_H+4)
+static uint8_t UIThumbBuf[UI_THUMB_OVERLAY_W/2*UI_THUMB_OVERLAY_H];
+struct ui_overlay UIThumbOverlay = {
+    (UI_MENU_X-UI_THUMB_OVERLAY_W-4)&~1, UI_MENU_Y,
+    UI_THUMB_OVERLAY_W, UI_THUMB_OVERLAY_H, UIThumbBuf, 0
+};
+
+// Performance HUD, bottom left of the Spectrum screen, see hud_frame().
+#define HUD_LINES 5
+#define HUD_COLS 13
+#define UI_HUD_W (HUD_COLS*8+4)
+#define UI_HUD_H (HUD_LINES*8+4)
+static uint8_t UIHudBuf[UI_HUD_W/2*UI_HUD_H];
+struct ui_overlay UIHudOverlay = {
+    32, 32+192-UI_HUD_H, UI_HUD_W, UI_HUD_H, UIHudBuf, 0
+};
+
+// Overlays merged by update_display(), NULL terminated.
+struct ui_overlay *UIOverlays[] = {
+    &UIMenuOverlay, &UIThumbOverlay, &UIHudOverlay, NULL
+};
+
+// Allow to draw everywhere on the current target. Called after we
+// finished updating a specific area to restore the normal state.
 void ui_reset_crop_area(void) {
-    ui_set_crop_area(0,st77_width-1,0,st77_height-1);
+    struct ui_overlay *o = EMU.ui_target;
+    if (o)
+        ui_set_crop_area(o->x,o->x+o->width-1,o->y,o->y+o->height-1);
+    else
+        ui_set_crop_area(0,st77_width-1,0,st77_height-1);
+}
+
+// Select the surface the ui_* primitives draw into: the overlay 'o', or
+// the Spectrum framebuffer if NULL. Coordinates are always framebuffer
+// coordinates. The crop area is reset to the whole target.
+void ui_set_target(struct ui_overlay *o) {
+    EMU.ui_target = o;
+    ui_reset_crop_area();
+}
+
+// Set 'fb' to the current drawing target, clipped to the crop area.
+static inline void ui_target_fb4(fb4_t *fb) {
+    struct ui_overlay *o = EMU.ui_target;
+    if (o == NULL)
+        fb4_init(fb,EMU.zx.fb,160,0,0,st77_width,st77_height);
+    else
+        fb4_init(fb,o->buf,o->width/2,o->x,o->y,o->width,o->height);
+    fb->cx1 = EMU.ui_crop_x1;
+    fb->cx2 = EMU.ui_crop_x2;
+    fb->cy1 = EMU.ui_crop_y1;
+    fb->cy2 = EMU.ui_crop_y2;
+}
+
+// Called by update_display() for every framebuffer line 'row' it
+// converts. If visible overlays cover the line, it is copied into 'buf'
+// (160 bytes) with the overlays merged, and 'buf' is returned. Otherwise
+// the framebuffer line itself is returned.
+uint8_t *ui_overlay_merge(uint32_t row, uint8_t *buf) {
+    uint8_t *line = EMU.zx.fb + row*160;
+    for (int j = 0; UIOverlays[j]; j++) {
+        struct ui_overlay *o = UIOverlays[j];
+        if (!o->visible || row < o->y || row >= (uint32_t)o->y+o->height)
+            continue;
+        if (line != buf) {
+            memcpy(buf,line,160);
+            line = buf;
+        }
+        const uint8_t *src = o->buf + (row-o->y)*(o->width/2);
+        uint8_t *dst = buf + o->x/2;
+        for (int x = 0; x < o->width/2; x++) {
+            uint8_t c = src[x];
+            if (c == UI_TRANSPARENT*0x11) continue;
+            if ((c>>4) == UI_TRANSPARENT)
+                dst[x] = (dst[x]&0xf0) | (c&0x0f);
+            else if ((c&0x0f) == UI_TRANSPARENT)
+                dst[x] = (dst[x]&0x0f) | (c&0xf0);
+            else
+                dst[x] = c;
+        }
+    }
+    return line;
+}
+
+// Set the pixels from x1 to x2 (included) of the line 'y' of the current
+// target to 'color', writing whole bytes where possible. No cropping is
+// done.
+void ui_fill_span(int y, int x1, int x2, uint8_t color) {
+    fb4_t fb;
+    ui_target_fb4(&fb);
+    fb4_span_noclip(&fb,y,x1,x2,color);
 }
 
 // This function writes a box (with the specified border, if given) directly
-// inside the ZX Spectrum CRT framebuffer. We use this primitive to draw our
-// UI, this way when we refresh the emulator framebuffer copying it to our
-// phisical display, the UI is also rendered.
+// inside the current drawing target: the menu overlay or the ZX Spectrum
+// CRT framebuffer. We use this primitive to draw our UI, this way when we
+// refresh the emulator framebuffer copying it to our phisical display,
+// the UI is also rendered.
 //
 // bcolor and color are from 0 to 15, and use the Spectrum palette (sorry :D).
 // bcolor is the color of the border. If you don't want a border, just use
 // bcolor the same as color.
 void ui_fill_box(uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint8_t color, uint8_t bcolor) {
-    uint16_t x2 = x+width-1;
-    uint16_t y2 = y+height-1;
-    uint8_t *crt = EMU.zx.fb;
-    for (int py = y; py <= y2; py++) {
-        for (int px = x; px <= x2; px++) {
-            // Don't draw outside the current mask.
-            if (px < EMU.ui_crop_x1 ||
-                px > EMU.ui_crop_x2 ||
-                py < EMU.ui_crop_y1 ||
-                py > EMU.ui_crop_y2) continue;
-
-            uint8_t *p = crt + py*160 + (px>>1);
-            // Border or inside?
-            uint8_t c = (px==x || px==x2 || py==y || py==y2) ? bcolor : color;
-
-            // CRT FB is 4 bit per pixel.
-            if (px&1)
-                *p = (*p&0xf0) | c;
-            else
-                *p = (*p&0x0f) | (c<<4);
-        }
-    }
+    fb4_t fb;
+    ui_target_fb4(&fb);
+    fb4_fill_rect(&fb,x,y,width,height,color);
+    if (bcolor != color) fb4_rect(&fb,x,y,width,height,bcolor);
 }
 
 // Draw a character on the screen.
-// We use the font in the Spectrum ROM to avoid providing one.
+// We use the font in the Spectrum ROM to avoid providing one (the copy
+// in the emulator state: the ROM image is in flash).
 // Size is the size multiplier.
 void ui_draw_char(uint16_t px, uint16_t py, uint8_t c, uint8_t color, uint8_t size) {
     c -= 0x20; // The Spectrum ROM font starts from ASCII 0x20 char.
-    uint8_t *font = dump_amstrad_zx48k_bin+0x3D00;
-    for (int y = 0; y < 8; y++) {
-        uint32_t row = font[c*8+y];
-        for (int x = 0; x < 8; x++) {
-            if (row & 0x80)
-                ui_fill_box(px+x*size,py+y*size,size,size,color,color);
-            row <<= 1;
-        }
-    }
+    uint8_t *font = EMU.zx.rom[0]+0x3D00+c*8;
+    fb4_t fb;
+    ui_target_fb4(&fb);
+    fb4_blit_mask(&fb,px,py,font,8,8,1,color,size);
 }
 
 // Draw the string 's' using the ROM font by calling ui_draw_char().
@@ -271,10 +533,10 @@ void ui_draw_string(uint16_t px, uint16_t py, const char *s, uint8_t color, uint
 // Load the prev/next game in the list (dir = -1 / 1).
 void ui_go_next_prev_game(int dir) {
     EMU.selected_game += dir;
-    if (EMU.selected_game == -SettingsListLen-1) {
+    if (EMU.selected_game == -(int)SettingsListLen-1) {
         EMU.selected_game = GamesTableSize-1;
-    } else if (EMU.selected_game == GamesTableSize) {
-        EMU.selected_game = -SettingsListLen;
+    } else if (EMU.selected_game >= (int)GamesTableSize) {
+        EMU.selected_game = -(int)SettingsListLen;
     }
 }
 
@@ -285,11 +547,10 @@ void ui_go_next_prev_game(int dir) {
 #define UI_DEBOUNCING_TIME 100000
 uint32_t ui_handle_key_press(void) {
     const uint8_t *km = keymap_default;
-    static absolute_time_t last_key_accepted_time = 0;
 
     // Debouncing
     absolute_time_t now = get_absolute_time();
-    if (now - last_key_accepted_time < UI_DEBOUNCING_TIME) return 0;
+    if (now - EMU.last_key_accepted_time < UI_DEBOUNCING_TIME) return 0;
 
     uint32_t event = UI_EVENT_NONE; // Event generated by key press, if any.
     int key_pressed = -1;
@@ -324,56 +585,173 @@ uint32_t ui_handle_key_press(void) {
         }
         break;
     }
-    last_key_accepted_time = now;
+    EMU.last_key_accepted_time = now;
     return event;
 }
 
-// If the menu is active, draw it.
-void ui_draw_menu(void) {
-    // Draw the menu in the right / top part of the screen.
-    int menu_x = st77_width/2;
-    int menu_w = st77_width/2-5;
-    int menu_y = 32; // Skip border in case it's not displayed.
-    int menu_h = (st77_height/3*2); // Use 2/3 of height.
-    int font_size = 2;
-    menu_h -= menu_h&(8*font_size-1); // Make multiple of font pixel size;
-    int vpad = 2;       // Vertical padding of text inside the box.
-    menu_h += vpad*2;   // Allow for pixels padding / top bottom.
-
-    ui_fill_box(menu_x, menu_y, menu_w, menu_h, 0, 15);
-    ui_set_crop_area(menu_x+1,menu_x+menu_w-2,
-                     menu_y+1,menu_y+menu_h-2);
-
-    int first_game = (int)EMU.selected_game - 5;
-    int num_settings = (int)SettingsListLen;
-    if (first_game < -num_settings) first_game = -num_settings;
+// What the menu overlay shows right now. ui_draw_menu() compares it with
+// the current state, and repaints only the rows that changed.
+static struct {
+    int first;                  // First item shown (scroll position).
+    int selected;               // Highlighted item.
+    uint32_t games;             // GamesTableSize when drawn.
+    uint32_t values[SettingsListLen]; // Setting values shown.
+    int thumb;                  // UIThumbOverlay shows a thumbnail.
+} UIMenu;
+
+/* Thumbnails are read from the flash, that is not reliable at the
+ * emulation clock, so the clock must be lowered for every read, like
+ * load_game() does. A few of them are cached, so that moving up and
+ * down the list does not hit the flash again and again. */
+#define UI_THUMB_CACHE 4
+static struct {
+    int game;                   // Game index + 1, or 0 for an empty slot.
+    uint32_t used;              // UIThumbClock at the last access.
+    uint8_t data[THUMB_BYTES];
+} UIThumbCache[UI_THUMB_CACHE];
+static uint32_t UIThumbClock;
+
+// Return the thumbnail of the game 'game_id', or NULL if it has none.
+const uint8_t *ui_thumb_get(int game_id) {
+    struct game_entry *g = &GamesTable[game_id];
+    if (g->thumb == NULL) return NULL;
+
+    int slot = 0;
+    for (int j = 0; j < UI_THUMB_CACHE; j++) {
+        if (UIThumbCache[j].game == game_id+1) {
+            slot = j;
+            goto found;
+        }
+        if (UIThumbCache[j].used < UIThumbCache[slot].used) slot = j;
+    }
+    set_sys_clock_khz(EMU.base_clock, false); sleep_us(50);
+    memcpy(UIThumbCache[slot].data,g->thumb,THUMB_BYTES);
+    set_sys_clock_khz(EMU.emu_clock, false); sleep_us(50);
+    UIThumbCache[slot].game = game_id+1;
 
-    int y = menu_y+vpad; // Incremented as we write text.
-    for (int j = first_game;; j++) {
-        if (j >= (int)GamesTableSize || y > menu_y+menu_h) break;
+found:
+    UIThumbCache[slot].used = ++UIThumbClock;
+    return UIThumbCache[slot].data;
+}
 
-        int color = j >= 0 ? 4 : 6;
-        font_size = j >= 0 ? 2 : 1;
+// Draw the thumbnail of the selected game, if any, into its overlay.
+void ui_draw_thumb(void) {
+    int sel = EMU.selected_game;
+    const uint8_t *thumb = NULL;
+    if (sel >= 0 && (uint32_t)sel < GamesTableSize) thumb = ui_thumb_get(sel);
+    UIMenu.thumb = thumb != NULL;
+    if (thumb == NULL) return;
+
+    struct ui_overlay *o = &UIThumbOverlay;
+    ui_set_target(o);
+    ui_fill_box(o->x,o->y,o->width,o->height,0,15);
+    fb4_t dst, src;
+    ui_target_fb4(&dst);
+    fb4_init(&src,(uint8_t*)thumb,THUMB_W/2,0,0,THUMB_W,THUMB_H);
+    fb4_copy_rect(&dst,o->x+2,o->y+2,&src,0,0,THUMB_W,THUMB_H);
+    ui_set_target(NULL);
+}
 
-        // Highlight the currently selected game, with a box of the color
-        // of the font, and the black font (so basically the font is inverted).
-        if (j == EMU.selected_game) {
-            ui_fill_box(menu_x+2,y,menu_w-2,font_size*8,color,color);
-            color = 0;
-        }
-        if (j < 0) {
-            // Show setting item.
-            struct UISettingsItem *si = &SettingsList[-j-1];
-            char sistr[32];
-            settings_to_string(sistr,sizeof(sistr),-j-1);
-            ui_draw_string(menu_x+2,y,sistr,color,font_size);
-        } else {
-            // Show game item.
-            ui_draw_string(menu_x+2,y,GamesTable[j].name,color,font_size);
+// Show or hide the menu overlays. The thumbnail is shown only if the
+// selected game has one.
+void ui_show_menu(int show) {
+    UIMenuOverlay.visible = show;
+    UIThumbOverlay.visible = show && UIMenu.thumb;
+}
+
+// Items are the settings (negative indexes, see EMU.selected_game) and
+// the games. Return the font size of the item 'j'.
+#define ui_menu_item_size(j) ((j) >= 0 ? 2 : 1)
+
+// Draw the menu item 'j' at 'y', clearing its row first. The crop area
+// must be the inside of the menu box.
+void ui_draw_menu_item(int j, int y) {
+    int font_size = ui_menu_item_size(j);
+    int color = j >= 0 ? 4 : 6;
+
+    ui_fill_box(UI_MENU_X+1,y,UI_MENU_W-2,font_size*8,0,0);
+
+    // Highlight the currently selected game, with a box of the color
+    // of the font, and the black font (so basically the font is inverted).
+    if (j == EMU.selected_game) {
+        ui_fill_box(UI_MENU_X+2,y,UI_MENU_W-2,font_size*8,color,color);
+        color = 0;
+    }
+    if (j < 0) {
+        // Show setting item.
+        char sistr[32];
+        settings_to_string(sistr,sizeof(sistr),-j-1);
+        ui_draw_string(UI_MENU_X+2,y,sistr,color,font_size);
+    } else {
+        // Show game item.
+        ui_draw_string(UI_MENU_X+2,y,GamesTable[j].name,color,font_size);
+    }
+}
+
+// Return the first item to show so that the selected one is fully
+// visible, scrolling as little as possible from the current position.
+int ui_menu_scroll(int first) {
+    int sel = EMU.selected_game;
+    int bottom = UI_MENU_Y+UI_MENU_H-2; // Last line inside the box.
+    if (sel < first) return sel;
+    for (;;) {
+        int y = UI_MENU_Y+UI_MENU_VPAD;
+        for (int j = first; j < sel; j++) y += 8*ui_menu_item_size(j);
+        if (y+8*ui_menu_item_size(sel)-1 <= bottom || first == sel)
+            return first;
+        first++;
+    }
+}
+
+// If the menu is active, draw it into its overlay. Only the items that
+// changed since the last call are drawn again: the previous and the new
+// selection, and the settings whose value changed (the audio sync also
+// changes by itself). Scrolling, or EMU.menu_redraw, draw everything.
+void ui_draw_menu(void) {
+    int num_settings = (int)SettingsListLen;
+    int first = UIMenu.first;
+    if (first < -num_settings || first >= (int)GamesTableSize)
+        first = -num_settings;
+    first = ui_menu_scroll(first);
+
+    int full = EMU.menu_redraw || first != UIMenu.first ||
+               GamesTableSize != UIMenu.games;
+    if (!full && EMU.selected_game == UIMenu.selected) {
+        int changed = 0;
+        for (int j = 0; j < num_settings; j++)
+            changed |= *SettingsList[j].ptr != UIMenu.values[j];
+        if (!changed) return; // Nothing to do: the common case.
+    }
+
+    ui_set_target(&UIMenuOverlay);
+    if (full) {
+        memset(UIMenuBuf,UI_TRANSPARENT*0x11,sizeof(UIMenuBuf));
+        ui_fill_box(UI_MENU_X, UI_MENU_Y, UI_MENU_W, UI_MENU_H, 0, 15);
+    }
+    ui_set_crop_area(UI_MENU_X+1,UI_MENU_X+UI_MENU_W-2,
+                     UI_MENU_Y+1,UI_MENU_Y+UI_MENU_H-2);
+
+    int y = UI_MENU_Y+UI_MENU_VPAD; // Incremented as we write text.
+    for (int j = first;; j++) {
+        if (j >= (int)GamesTableSize || y > UI_MENU_Y+UI_MENU_H) break;
+        if (full || j == EMU.selected_game || j == UIMenu.selected ||
+            (j < 0 && *SettingsList[-j-1].ptr != UIMenu.values[-j-1]))
+        {
+            ui_draw_menu_item(j,y);
         }
-        y += 8*font_size;
+        y += 8*ui_menu_item_size(j);
     }
-    ui_reset_crop_area();
+    if (full && GamesTableSize == 0 && y <= UI_MENU_Y+UI_MENU_H)
+        ui_draw_string(UI_MENU_X+2,y,"No games in flash",2,1);
+    ui_set_target(NULL);
+    if (full || EMU.selected_game != UIMenu.selected) ui_draw_thumb();
+
+    UIMenu.first = first;
+    UIMenu.selected = EMU.selected_game;
+    UIMenu.games = GamesTableSize;
+    for (int j = 0; j < num_settings; j++)
+        UIMenu.values[j] = *SettingsList[j].ptr;
+    EMU.menu_redraw = 0;
 }
 
 /* =========================== Emulator implementation ====================== */
@@ -410,7 +788,9 @@ uint16_t palette_to_565(uint32_t color) {
 // BORDERS:
 // If border is false, borders are not drawn at all.
 // Useful for small displays or when scaling is used.
-void update_display(uint32_t scaling, uint32_t border) {
+//
+// Returns the number of bytes transferred to the display.
+uint32_t update_display(uint32_t scaling, uint32_t border) {
     uint16_t line[st77_width+1]={0}; // One pixel more allow us to overflow
                                      // when doing scaling, instead of checking
                                      // (which is costly). Hence width+1.
@@ -468,10 +848,12 @@ void update_display(uint32_t scaling, uint32_t border) {
     // we want to duplicate lines every N cols/rows when scaling is
     // used, and when this happens we advance x and y by a pixel more,
     // so we need counters relative to the Spectrum video, not the display.
-    uint32_t yy = 0;
+    uint32_t yy = 0, sent = 0;
+    uint8_t merged[160];    // Framebuffer line with the UI overlays.
     for (uint32_t y = 0; y < st77_height; y++) {
-        uint8_t *p = crt;
         int xx = xx_start;
+        perf_cycles_begin(PERF_CONVERT);
+        uint8_t *p = ui_overlay_merge((crt-EMU.zx.fb)/160,merged);
         for (uint32_t x = 0; x < st77_width && xx < 160; x += 2) {
             line[x] = zxpalette[(p[xx]>>4)&0xf];
             line[x+1] = zxpalette[p[xx]&0xf];
@@ -486,7 +868,9 @@ void update_display(uint32_t scaling, uint32_t border) {
             }
             xx++;
         }
+        perf_cycles_end(PERF_CONVERT);
 
+        perf_cycles_begin(PERF_XFER);
         if (((yy+1)&y_dup_mask) == 0) {
             // Duplicate/skip row according to scaling mask.
             if (dup) {
@@ -495,6 +879,7 @@ void update_display(uint32_t scaling, uint32_t border) {
                 y++;
                 st77xx_setwin(0, y, st77_width-1, y);
                 st77xx_data(line,sizeof(line)-2);
+                sent += (sizeof(line)-2)*2;
             } else {
                 y--;    // Skip row.
             }
@@ -503,11 +888,14 @@ void update_display(uint32_t scaling, uint32_t border) {
             // write it to the display.
             st77xx_setwin(0, y, st77_width-1, y);
             st77xx_data(line,sizeof(line)-2);
+            sent += sizeof(line)-2;
         }
+        perf_cycles_end(PERF_XFER);
 
         crt += 160; yy++; // Next row.
         if (crt >= EMU.zx.fb+ZX_FRAMEBUFFER_SIZE_BYTES) break;
     }
+    return sent;
 }
 
 // This function maps GPIO state to the Spectrum keyboard registers.
@@ -516,7 +904,7 @@ void update_display(uint32_t scaling, uint32_t border) {
 #define HANDLE_KEYPRESS_MACRO 1
 #define HANDLE_KEYPRESS_PIN 2
 #define HANDLE_KEYPRESS_ALL (HANDLE_KEYPRESS_MACRO|HANDLE_KEYPRESS_PIN)
-void handle_zx_key_press(zx_t *zx, const uint8_t *keymap, uint32_t ticks, int flags) {
+void handle_zx_key_press(zx_t *zx, const uint8_t *keymap, kmap_timeline_t *macros, uint32_t ticks, int flags) {
     // This 128 bit bitmap remembers what keys we put down
     // during this call. This is useful as sometimes key maps
     // have multiple keys mapped to the same Spectrum key, and if
@@ -526,25 +914,16 @@ void handle_zx_key_press(zx_t *zx, const uint8_t *keymap, uint32_t ticks, int fl
     #define put_down_set(keycode) put_down[keycode>>6] |= (1ULL<<(keycode&63))
     #define put_down_get(keycode) (put_down[keycode>>6] & (1ULL<<(keycode&63)))
 
-    for (int j = 0; ;j += 3) {
+    for (int j = 0; flags & HANDLE_KEYPRESS_PIN; j += 3) {
         if (keymap[j] == KEY_END) {
             // End of keymap reached.
             break;
-        } else if ((keymap[j] == PRESS_AT_TICK ||
-                    keymap[j] == RELEASE_AT_TICK) &&
-                  keymap[j+1] == ticks)
-        {
-            // Press/release keys when a given frame is reached.
-            if (!(flags & HANDLE_KEYPRESS_MACRO)) continue;
-            if (keymap[j] == PRESS_AT_TICK) {
-                zx_key_down(zx,keymap[j+2]);
-            } else {
-                zx_key_up(zx,keymap[j+2]);
-            }
+        } else if (kmap_is_macro_row(keymap+j)) {
+            // Macros are handled by the timeline below.
+            continue;
         } else {
             // Map the GPIO status to the ZX Spectrum keyboard
             // registers.
-            if (!(flags & HANDLE_KEYPRESS_PIN)) continue;
             if (!(keymap[j] & KEY_EXT)) {
                 // Normal key maps: Pico pin -> two Spectrum keys.
                 if (get_device_button(keymap[j])) {
@@ -570,7 +949,9 @@ void handle_zx_key_press(zx_t *zx, const uint8_t *keymap, uint32_t ticks, int fl
                 {
                     put_down_set(keymap[j+2]);
                     zx_key_down(zx,keymap[j+2]);
-                    return; // Return ASAP before processing normal keys.
+                    // Stop ASAP before processing normal keys. Macros
+                    // due in this frame run at the next one.
+                    return;
                 } else {
                     if (!put_down_get(keymap[j+2])) zx_key_up(zx,keymap[j+2]);
                 }
@@ -578,19 +959,39 @@ void handle_zx_key_press(zx_t *zx, const uint8_t *keymap, uint32_t ticks, int fl
         }
     }
 
+    // Press/release keys when a given frame is reached. This must happen
+    // after the pins are processed, otherwise a button that is not
+    // pressed would release the key the macro just put down.
+    if (flags & HANDLE_KEYPRESS_MACRO) kmap_timeline_run(macros,zx,ticks);
+
     // Detect long press of left+right to return back in
     // game selection mode.
     {
         #define LEFT_RIGHT_LONG_PRESS_FRAMES 30
-        static int left_right_frames = 0;
         if (get_device_button(KEY_LEFT) && get_device_button(KEY_RIGHT)) {
-            left_right_frames++;
-            if (left_right_frames == LEFT_RIGHT_LONG_PRESS_FRAMES)
+            EMU.left_right_frames++;
+            if (EMU.left_right_frames == LEFT_RIGHT_LONG_PRESS_FRAMES)
                 EMU.menu_active = 1;
         } else {
-            left_right_frames = 0;
+            EMU.left_right_frames = 0;
         }
     }
+
+    // Long press of up+down toggles the performance HUD. With fire held
+    // as well, it prints the execution trace instead, if enabled.
+    if (get_device_button(KEY_UP) && get_device_button(KEY_DOWN)) {
+        EMU.up_down_frames++;
+        if (EMU.up_down_frames == LEFT_RIGHT_LONG_PRESS_FRAMES) {
+#if Z80_TRACE_LEN
+            if (get_device_button(KEY_FIRE))
+                trace_dump_current();
+            else
+#endif
+            hud_show(!EMU.hud_active);
+        }
+    } else {
+        EMU.up_down_frames = 0;
+    }
 }
 
 // Clear all keys. Useful when we switch game, to make sure that no
@@ -612,15 +1013,28 @@ void set_volume(uint32_t volume) {
     pwm_set_enabled(slice_num, volume != 0);
 }
 
+// Hypercalls of the guest (see zx.h). They are only enabled in debug
+// mode, where they are just logged with a timestamp, so that test
+// programs can be timed on the device as well.
+void debug_hypercall(zx_t *zx, uint8_t cmd, uint16_t hl, uint16_t de) {
+    (void)zx;
+    printf("[hcall] frame %lu at %llu us: cmd %u hl %u de %u\n",
+        (unsigned long)EMU.tick, (unsigned long long)time_us_64(),
+        cmd, hl, de);
+}
+
 // Initialize the Pico and the Spectrum emulator.
 void init_emulator(void) {
     // Set default configuration.
     EMU.debug = 0;
+    EMU.benchmark = 0;
     EMU.menu_active = 1;
+    EMU.menu_redraw = 1;
     EMU.base_clock = 280000;
     EMU.emu_clock = 400000;
     EMU.tick = 0;
     EMU.current_keymap = keymap_default;
+    kmap_timeline_build(&EMU.macros,EMU.current_keymap);
     EMU.selected_game = 0;
     EMU.show_border = DEFAULT_DISPLAY_BORDERS;
     EMU.scaling = DEFAULT_DISPLAY_SCALING;
@@ -639,9 +1053,23 @@ void init_emulator(void) {
     st77xx_fill_box(0,st77_height-41,40,40,st77xx_rgb565(0,0,255));
     st77xx_fill_box(st77_width-41,st77_height-41,40,40,st77xx_rgb565(50,50,50));
 
+    // Read the games catalog while we are still at the default clock,
+    // since flash access is not reliable at higher speeds.
+    games_catalog_load((const uint8_t*)GAMES_FLASH_ADDR,GAMES_FLASH_MAX_LEN);
+
+    // ZX emulator Init. Also copies the ROM from flash, so it must be
+    // done before overclocking as well.
+    zx_desc_t zx_desc = {0};
+    zx_desc.type = ZX_TYPE_48K;
+    zx_desc.joystick_type = ZX_JOYSTICKTYPE_KEMPSTON;
+    zx_desc.roms.zx48k.ptr = dump_amstrad_zx48k_bin;
+    zx_desc.roms.zx48k.size = sizeof(dump_amstrad_zx48k_bin);
+    zx_init(&EMU.zx, &zx_desc);
+
     // Overclocking
     vreg_set_voltage(VREG_VOLTAGE_1_30);
     set_sys_clock_khz(EMU.emu_clock, false);
+    perf_init();
 
     // Keys pin initialization
     gpio_init(KEY_LEFT);
@@ -666,27 +1094,47 @@ void init_emulator(void) {
     for (int j = 0; j < 16; j++)
         zxpalette[j] = palette_to_565(zxpalette[j]);
 
-    // ZX emulator Init
-    zx_desc_t zx_desc = {0};
-    zx_desc.type = ZX_TYPE_48K;
-    zx_desc.joystick_type = ZX_JOYSTICKTYPE_KEMPSTON;
-    zx_desc.roms.zx48k.ptr = dump_amstrad_zx48k_bin;
-    zx_desc.roms.zx48k.size = sizeof(dump_amstrad_zx48k_bin);
-    zx_init(&EMU.zx, &zx_desc);
-
     // Enter special mode depending on key presses during power up.
     if (get_device_button(KEY_LEFT)) EMU.debug = 1; // Debugging mode.
     if (get_device_button(KEY_RIGHT)) EMU.emu_clock = 300000; // Less overclock.
+    if (get_device_button(KEY_FIRE)) EMU.benchmark = 1; // Benchmark mode.
+    if (EMU.debug) zx_hypercall_enable(&EMU.zx,debug_hypercall);
+    watchdog_report();
+}
+
+// Return the keymap to use for the game 'g'. If the game has a keymap
+// in the flash memory, it is validated and translated into EMU.keymap_buf,
+// otherwise (or if the flash keymap is broken) the builtin keymap with
+// the game name is used.
+const uint8_t *game_keymap(struct game_entry *g) {
+    static const uint8_t pins[KMAP_BTN_COUNT] = {
+        [KMAP_BTN_LEFT] = KEY_LEFT,
+        [KMAP_BTN_RIGHT] = KEY_RIGHT,
+        [KMAP_BTN_FIRE] = KEY_FIRE,
+        [KMAP_BTN_UP] = KEY_UP,
+        [KMAP_BTN_DOWN] = KEY_DOWN,
+    };
+
+    if (g->map) {
+        const char *err;
+        if (kmap_load(EMU.keymap_buf,g->map,g->map_size,pins,&err) == 0)
+            return EMU.keymap_buf;
+        printf("Keymap of %s rejected: %s\n", g->name, err);
+    }
+    return builtin_keymap_lookup(g->name);
 }
 
 /* Load the specified game ID. The ID is just the index in the
  * games table. As a side effect, sets the keymap. */
 void load_game(int game_id) {
+    if (game_id < 0 || (uint32_t)game_id >= GamesTableSize) return;
     set_sys_clock_khz(EMU.base_clock, false); sleep_us(50);
     struct game_entry *g = &GamesTable[game_id];
-    chips_range_t r = {.ptr=g->addr, .size=g->size};
+    chips_range_t r = {.ptr=(void*)g->addr, .size=g->size};
     flush_zx_key_press(&EMU.zx); // Make sure no keys are down.
-    EMU.current_keymap = g->map;
+    EMU.current_keymap = game_keymap(g);
+    if (kmap_timeline_build(&EMU.macros,EMU.current_keymap))
+        printf("Warning: too many key macros for %s\n", g->name);
     EMU.tick = 0;
     zx_quickload(&EMU.zx, r);
     EMU.loaded_game = game_id;
@@ -715,9 +1163,14 @@ void core1_play_audio(void) {
         end = get_absolute_time();
         if (EMU.debug)
             printf("[playback] waiting %llu [%u]\n",
-                end-start, EMU.zx.audiobuf_notify);
-        if (end-start == 0) EMU.audio_sample_wait--;
-        else if (end-start > 1000) EMU.audio_sample_wait++;
+                (unsigned long long)(end-start),
+                (unsigned)EMU.zx.audiobuf_notify);
+        if (end-start == 0) {
+            EMU.audio_sample_wait--;
+        } else if (end-start > 1000) {
+            EMU.audio_sample_wait++;
+            EMU.audio_underruns++;
+        }
 
         // Seek the right part of the buffer. We use double buffering
         // splitting the buffer in two. This is needed as memcpy()-ing
@@ -726,6 +1179,7 @@ void core1_play_audio(void) {
         uint32_t *buf = EMU.zx.audiobuf;
         buf += (EMU.zx.audiobuf_notify-1)*(AUDIOBUF_LEN/2);
         EMU.zx.audiobuf_notify = 0; // Clear notification flag.
+        watchdog_heartbeat(1,0);
 
         // Play samples.
         start = get_absolute_time();
@@ -738,29 +1192,643 @@ void core1_play_audio(void) {
                 }
 
                 // Wait some time.
-                for (volatile int k = 0; k < EMU.audio_sample_wait; k++);
-
-                // Stop if there was a buffer overrun. Very unlikely.
-                // if (EMU.zx.audiobuf_notify != 0) goto stoploop;
+                for (volatile uint32_t k = 0; k < EMU.audio_sample_wait; k++);
             }
         }
-        stoploop:
         end = get_absolute_time();
         if (EMU.debug)
             printf("[playback] with pause=%u playing took %llu [notify:%u]\n",
-                EMU.audio_sample_wait, end-start, EMU.zx.audiobuf_notify);
+                (unsigned)EMU.audio_sample_wait,
+                (unsigned long long)(end-start),
+                (unsigned)EMU.zx.audiobuf_notify);
+    }
+}
+
+// Queue the telemetry record of the frame just executed. Must be called
+// after perf_frame_done().
+void queue_frame_telemetry(uint32_t tstates, uint32_t display_bytes) {
+    struct telemetry_frame f = {
+        .tick = EMU.tick,
+        .tstates = tstates,
+        .clock_khz = clock_get_hz(clk_sys)/1000,
+        .display_bytes = display_bytes,
+        .audio_pos = EMU.zx.audiobuf_byte*32+EMU.zx.audiobuf_bit,
+        .audio_wait = EMU.audio_sample_wait,
+        .audio_notify = EMU.zx.audiobuf_notify,
+        .menu_active = EMU.menu_active,
+    };
+    memcpy(f.perf,Perf.frame,sizeof(f.perf));
+    telemetry_push_frame(&f);
+}
+
+#if ZX_DEBUGGER
+/* ================================ Debugger ================================
+ * With ZX_DEBUGGER (cmake -DZX_DEBUGGER=ON) the emulator accepts debugger
+ * commands on the USB serial, one per line, addresses and lengths in hex:
+ *
+ *   b <addr>              Set a breakpoint.
+ *   bc <addr>             Clear a breakpoint.
+ *   w <addr> [len] [r|w]  Watch len (default 1) bytes for reads and/or
+ *                         writes (default both).
+ *   wc <addr>             Remove the watchpoints starting at addr.
+ *   d                     Remove all breakpoints and watchpoints.
+ *   c                     Continue after a stop.
+ *   s                     Step: run to the next instruction.
+ *   r                     Print the registers.
+ *   m <addr> [len]        Dump len (default 40) bytes of memory.
+ *
+ * When a breakpoint or a watchpoint hits, the Spectrum is stopped (the
+ * display and the menu keep working) and the reason and the registers
+ * are printed. See zx_debug_t in zx.h. */
+
+#define DEBUG_LINE_LEN 32
+
+static struct {
+    char line[DEBUG_LINE_LEN];  // Command being received.
+    int len;
+} DebugInput;
+
+void debug_print_registers(void) {
+    z80_t *cpu = &EMU.zx.cpu;
+    printf("[debug] pc %04x sp %04x af %04x bc %04x de %04x hl %04x "
+           "ix %04x iy %04x af' %04x bc' %04x de' %04x hl' %04x "
+           "ir %04x im %u iff %u%u frame %lu\n",
+        cpu->pc, cpu->sp, cpu->af, cpu->bc, cpu->de, cpu->hl,
+        cpu->ix, cpu->iy, cpu->af2, cpu->bc2, cpu->de2, cpu->hl2,
+        cpu->ir, cpu->im, cpu->iff1, cpu->iff2, (unsigned long)EMU.tick);
+}
+
+// Called after zx_exec() stopped because of the debugger.
+void debug_print_stop(void) {
+    zx_debug_t *dbg = &EMU.zx.debug;
+    static const char *reason[] = {
+        [ZX_DEBUG_BREAK] = "break", [ZX_DEBUG_READ] = "read",
+        [ZX_DEBUG_WRITE] = "write", [ZX_DEBUG_STEP] = "step"
+    };
+    if (dbg->stop == ZX_DEBUG_READ || dbg->stop == ZX_DEBUG_WRITE)
+        printf("[debug] %s %04x value %02x\n", reason[dbg->stop],
+            dbg->stop_addr, dbg->stop_data);
+    else
+        printf("[debug] %s at %04x\n", reason[dbg->stop], dbg->stop_addr);
+    debug_print_registers();
+}
+
+void debug_dump_memory(uint16_t addr, uint32_t len) {
+    for (uint32_t j = 0; j < len; j++) {
+        if (j % 16 == 0) printf("%s[debug] %04x:", j ? "\n" : "",
+                                (uint16_t)(addr+j));
+        printf(" %02x", mem_rd(&EMU.zx.mem, addr+j));
+    }
+    printf("\n");
+}
+
+// Execute the debugger command 'line'.
+void debug_command(char *line) {
+    char cmd[4], arg[4];
+    unsigned int addr = 0, len = 0;
+    arg[0] = 0;
+    int argc = sscanf(line,"%3s %x %x %3s",cmd,&addr,&len,arg);
+    if (argc < 1) return;
+    addr &= 0xffff;
+
+    if (!strcmp(cmd,"b") && argc >= 2) {
+        zx_debug_break(&EMU.zx,addr,true);
+    } else if (!strcmp(cmd,"bc") && argc >= 2) {
+        zx_debug_break(&EMU.zx,addr,false);
+    } else if (!strcmp(cmd,"w") && argc >= 2) {
+        // The direction may come in place of the length.
+        if (argc == 2) {
+            len = 1;
+            sscanf(line,"%*s %*x %3s",arg);
+        }
+        uint8_t dir = (strchr(arg,'r') ? ZX_IO_RD : 0) |
+                      (strchr(arg,'w') ? ZX_IO_WR : 0);
+        if (!dir) dir = ZX_IO_RD|ZX_IO_WR;
+        if (!zx_debug_watch(&EMU.zx,addr,len ? len : 1,dir))
+            printf("[debug] too many watchpoints\n");
+    } else if (!strcmp(cmd,"wc") && argc >= 2) {
+        zx_debug_unwatch(&EMU.zx,addr);
+    } else if (!strcmp(cmd,"d")) {
+        zx_debug_clear(&EMU.zx);
+    } else if (!strcmp(cmd,"c")) {
+        zx_debug_continue(&EMU.zx);
+    } else if (!strcmp(cmd,"s")) {
+        zx_debug_step(&EMU.zx);
+    } else if (!strcmp(cmd,"r")) {
+        debug_print_registers();
+    } else if (!strcmp(cmd,"m") && argc >= 2) {
+        debug_dump_memory(addr,argc >= 3 ? len : 0x40);
+    } else {
+        printf("[debug] unknown command: %s\n", line);
     }
 }
 
+// Collect the serial input into debugger command lines. Returns 0 if
+// the character 'c' is not for the debugger: the single character
+// commands of handle_serial_commands() at the start of a line.
+int debug_input(int c) {
+    if (DebugInput.len == 0 && (c == 'p' || c == 't' || c == 'x')) return 0;
+    if (c == '\r' || c == '\n') {
+        DebugInput.line[DebugInput.len] = 0;
+        if (DebugInput.len) debug_command(DebugInput.line);
+        DebugInput.len = 0;
+    } else if (DebugInput.len < DEBUG_LINE_LEN-1) {
+        DebugInput.line[DebugInput.len++] = c;
+    }
+    return 1;
+}
+#endif
+
+#if Z80_TRACE_LEN
+/* ============================ Execution trace =============================
+ * With a trace length set (cmake -DZX_TRACE_LEN=1024, see Z80_TRACE_LEN
+ * in z80.h) the CPU keeps the PCs of the last instructions executed and
+ * the interrupts taken. Send 'x' on the USB serial, or long press
+ * up+down+fire, to print it, in the format host/trace.py decodes:
+ *
+ *   [trace] begin <game> <entries>
+ *   [trace] 8a3f 8a41 8a42 i8a42 0038 ...   16 entries per line
+ *   [trace] end
+ *
+ * Oldest entry first. Entries are PCs in hex, or the return address of
+ * an interrupt, prefixed by 'i', or 'n' for the NMI. */
+
+// Print the trace 'trace', a ring of 'len' entries (a power of 2) with
+// 'pos' entries written so far.
+void trace_dump(const char *game, const uint32_t *trace, uint32_t len,
+                uint32_t pos)
+{
+    // Once the buffer wrapped, the oldest slot may hold a HALT that
+    // was not counted: skip it.
+    uint32_t count = pos < len ? pos : len-1;
+    printf("[trace] begin %s %lu", game, (unsigned long)count);
+    for (uint32_t j = 0; j < count; j++) {
+        uint32_t e = trace[(pos-count+j) & (len-1)];
+        if (j % 16 == 0) printf("\n[trace]");
+        printf(" %s%04x", (e & Z80_TRACE_INT) ? "i" :
+                          (e & Z80_TRACE_NMI) ? "n" : "", (unsigned)e & 0xffff);
+    }
+    printf("\n[trace] end\n");
+}
+
+// Print the trace of the running game.
+void trace_dump_current(void) {
+    trace_dump(GamesTableSize ? GamesTable[EMU.loaded_game].name : "-",
+               EMU.zx.cpu.trace, Z80_TRACE_LEN, EMU.zx.cpu.trace_pos);
+}
+#endif
+
+/* ============================== Hang watchdog =============================
+ * If the emulation hangs (a runaway in z80_tick(), core 1 waiting forever
+ * for audio that never comes...) the device would just freeze. Instead,
+ * core 0 bumps a heartbeat counter at every frame and core 1 at every
+ * audio chunk played, and a timer interrupt on core 0 checks them every
+ * WATCHDOG_CHECK_MS, feeding the hardware watchdog while they advance.
+ * When one of them is stuck for WATCHDOG_STALL_MS, the registers, the
+ * heartbeats and, with Z80_TRACE_LEN, the last PCs are saved into a RAM
+ * area that the reset does not clear, and the chip is reset. At the next
+ * boot the record is printed on the USB serial:
+ *
+ *   [watchdog] core 0 hang, game jetpac frame 1234
+ *   [watchdog] heartbeats 8812 3010 emulated frames 8790
+ *   [watchdog] pc 8a3f sp ff3c af 0044 ...
+ *   [trace] ...     With Z80_TRACE_LEN: the last PCs, see above.
+ *
+ * Core 1 only plays what core 0 produces, so it is considered stuck only
+ * if core 0 kept emulating frames in the meantime: a stop of the
+ * debugger is not a hang. If core 0 hangs with the interrupts disabled
+ * the timer can't run either, and it is the hardware watchdog that
+ * resets the chip after WATCHDOG_HW_MS: only the heartbeats are reported
+ * then, since nothing could be saved. */
+
+#define WATCHDOG_CHECK_MS 100       // Heartbeats check period.
+#define WATCHDOG_STALL_MS 1000      // Time without heartbeats for a hang.
+#define WATCHDOG_HW_MS 3000         // Hardware watchdog timeout.
+// PCs saved: 64, or less if the trace itself is shorter, so that every
+// slot of the saved ring is written. Both are powers of two.
+#define WATCHDOG_TRACE_LEN (Z80_TRACE_LEN < 64 ? Z80_TRACE_LEN : 64)
+
+#define WATCHDOG_RUNNING 0x5a585752 // "ZXWR": heartbeats valid.
+#define WATCHDOG_CAPTURED 0x5a585743 // "ZXWC": state saved too.
+
+typedef struct {
+    uint32_t magic;             // WATCHDOG_RUNNING/CAPTURED, or garbage.
+    volatile uint32_t heartbeat[2]; // Frames of core 0, chunks of core 1.
+    volatile uint32_t frames;   // Frames where the Spectrum ran.
+    // Saved when the hang is detected.
+    uint32_t core;              // Core that stopped its heartbeat.
+    uint32_t tick;              // EMU.tick.
+    int32_t game;               // EMU.loaded_game.
+    uint16_t pc, sp, af, bc, de, hl, ix, iy, af2, bc2, de2, hl2, ir;
+    uint8_t im, iff1, iff2;
+#if Z80_TRACE_LEN
+    uint32_t trace_pos;
+    uint32_t trace[WATCHDOG_TRACE_LEN];
+#endif
+} watchdog_record;
+
+// Not initialized at boot, so it is still there after the reset.
+static watchdog_record __uninitialized_ram(WatchdogRecord);
+
+static struct {
+    repeating_timer_t timer;
+    int check_core1;            // Is core 1 running?
+    uint32_t last[2], last_frames; // Counters at the previous check.
+    uint32_t stalled[2];        // Checks without heartbeat.
+} Watchdog;
+
+// Called by 'core' (0 or 1) once per frame / audio chunk. 'frames' is
+// one if the Spectrum ran in this frame (only meaningful for core 0).
+// Each counter has a single writer: core 1 must not touch 'frames', or
+// its read-modify-write could lose an increment of core 0.
+void watchdog_heartbeat(int core, uint32_t frames) {
+    WatchdogRecord.heartbeat[core]++;
+    if (core == 0) WatchdogRecord.frames += frames;
+}
+
+// Save the emulator state: 'core' stopped its heartbeat.
+static void watchdog_capture(uint32_t core) {
+    watchdog_record *r = &WatchdogRecord;
+    z80_t *cpu = &EMU.zx.cpu;
+    r->core = core;
+    r->tick = EMU.tick;
+    r->game = EMU.loaded_game;
+    r->pc = cpu->pc; r->sp = cpu->sp; r->af = cpu->af; r->bc = cpu->bc;
+    r->de = cpu->de; r->hl = cpu->hl; r->ix = cpu->ix; r->iy = cpu->iy;
+    r->af2 = cpu->af2; r->bc2 = cpu->bc2; r->de2 = cpu->de2;
+    r->hl2 = cpu->hl2; r->ir = cpu->ir;
+    r->im = cpu->im; r->iff1 = cpu->iff1; r->iff2 = cpu->iff2;
+#if Z80_TRACE_LEN
+    uint32_t pos = cpu->trace_pos;
+    uint32_t n = pos < WATCHDOG_TRACE_LEN ? pos : WATCHDOG_TRACE_LEN;
+    for (uint32_t j = pos-n; j != pos; j++)
+        r->trace[j & (WATCHDOG_TRACE_LEN-1)] =
+            cpu->trace[j & (Z80_TRACE_LEN-1)];
+    r->trace_pos = pos;
+#endif
+    r->magic = WATCHDOG_CAPTURED;
+}
+
+// Timer callback, in interrupt context on core 0.
+static bool watchdog_check(repeating_timer_t *t) {
+    (void)t;
+    watchdog_record *r = &WatchdogRecord;
+    uint32_t frames = r->frames;
+    for (int core = 0; core < 2; core++) {
+        uint32_t hb = r->heartbeat[core];
+        if (hb != Watchdog.last[core] || (core == 1 && !Watchdog.check_core1))
+            Watchdog.stalled[core] = 0;
+        else if (core == 0 || frames != Watchdog.last_frames)
+            Watchdog.stalled[core]++;
+        Watchdog.last[core] = hb;
+        if (Watchdog.stalled[core] >= WATCHDOG_STALL_MS/WATCHDOG_CHECK_MS) {
+            watchdog_capture(core);
+            watchdog_reboot(0,0,0);
+            return false;
+        }
+    }
+    Watchdog.last_frames = frames;
+    watchdog_update();
+    return true;
+}
+
+// Start the supervisor. Must be called by core 0.
+void watchdog_start(int check_core1) {
+    WatchdogRecord.heartbeat[0] = WatchdogRecord.heartbeat[1] = 0;
+    WatchdogRecord.frames = 0;
+    WatchdogRecord.magic = WATCHDOG_RUNNING;
+    Watchdog.check_core1 = check_core1;
+    watchdog_enable(WATCHDOG_HW_MS,1);
+    add_repeating_timer_ms(WATCHDOG_CHECK_MS,watchdog_check,NULL,
+                           &Watchdog.timer);
+}
+
+// If the last reset was caused by a hang, print what was saved. Must be
+// called after the games catalog is loaded.
+//
+// The magic alone is not enough: it stays WATCHDOG_RUNNING for the whole
+// run, and watchdog_caused_reboot() is also true after a reboot asked via
+// USB or by watchdog_reboot(). So a RUNNING record is reported only if the
+// watchdog armed by watchdog_start() timed out, and a CAPTURED one only
+// after the watchdog_reboot() of watchdog_check(). The record is cleared
+// at every boot, so a stale one is never reported later.
+void watchdog_report(void) {
+    watchdog_record *r = &WatchdogRecord;
+    uint32_t magic = r->magic;
+    r->magic = 0;
+    if (!(magic == WATCHDOG_RUNNING && watchdog_enable_caused_reboot()) &&
+        !(magic == WATCHDOG_CAPTURED && watchdog_caused_reboot()))
+        return;
+
+    // Give the host some time to open the USB serial.
+    for (int j = 0; j < 20 && !stdio_usb_connected(); j++) sleep_ms(100);
+    const char *game = (uint32_t)r->game < GamesTableSize ?
+                       GamesTable[r->game].name : "-";
+    if (magic == WATCHDOG_RUNNING) {
+        printf("[watchdog] hardware watchdog reset, state not saved\n");
+    } else {
+        printf("[watchdog] core %lu hang, game %s frame %lu\n",
+            (unsigned long)r->core, game, (unsigned long)r->tick);
+    }
+    printf("[watchdog] heartbeats %lu %lu emulated frames %lu\n",
+        (unsigned long)r->heartbeat[0], (unsigned long)r->heartbeat[1],
+        (unsigned long)r->frames);
+    if (magic == WATCHDOG_CAPTURED) {
+        printf("[watchdog] pc %04x sp %04x af %04x bc %04x de %04x hl %04x "
+               "ix %04x iy %04x af' %04x bc' %04x de' %04x hl' %04x "
+               "ir %04x im %u iff %u%u\n",
+            r->pc, r->sp, r->af, r->bc, r->de, r->hl, r->ix, r->iy,
+            r->af2, r->bc2, r->de2, r->hl2, r->ir, r->im, r->iff1, r->iff2);
+#if Z80_TRACE_LEN
+        trace_dump(game,r->trace,WATCHDOG_TRACE_LEN,r->trace_pos);
+#endif
+    }
+}
+
+// Commands received via USB serial, one character each:
+// 'p' prints the performance report now, 't' toggles binary telemetry,
+// 'x' prints the execution trace if enabled. With ZX_DEBUGGER, the
+// other input is for the debugger, see above.
+void handle_serial_commands(void) {
+    int c;
+    while ((c = getchar_timeout_us(0)) != PICO_ERROR_TIMEOUT) {
+#if ZX_DEBUGGER
+        if (debug_input(c)) continue;
+#endif
+        switch(c) {
+        case 'p': perf_report(); break;
+        case 't': telemetry_enable(!Telemetry.enabled); break;
+#if Z80_TRACE_LEN
+        case 'x': trace_dump_current(); break;
+#endif
+        }
+    }
+}
+
+/* ============================ Performance HUD =============================
+ * Toggled holding up+down. Shows, averaged over the last update period:
+ * the emulated speed (100% = real Spectrum) and the clock, the Z80
+ * emulation, video decoding and display update milliseconds per frame,
+ * the frames that took longer than the Spectrum time they emulated, and
+ * the audio underruns (the playback had to wait for data).
+ *
+ * The HUD is an overlay, updated at most every HUD_UPDATE_USEC, and only
+ * the lines whose text changed are drawn again. */
+
+#define HUD_UPDATE_USEC 250000
+
+static struct {
+    uint64_t tstates;           // Accumulators since the last update.
+    uint64_t exec_us, decode_cyc, display_cyc;
+    uint32_t frames, late;
+    uint32_t last_update;       // time_us_32() of the last update.
+    uint32_t underruns;         // EMU.audio_underruns at the last update.
+    char text[HUD_LINES][HUD_COLS+1]; // Lines shown right now.
+} Hud;
+
+// Show or hide the HUD. When shown, it starts from a clean state.
+void hud_show(int show) {
+    EMU.hud_active = show;
+    UIHudOverlay.visible = 0; // Until the first update.
+    if (!show) return;
+    memset(&Hud,0,sizeof(Hud));
+    Hud.last_update = time_us_32();
+    Hud.underruns = EMU.audio_underruns;
+    ui_set_target(&UIHudOverlay);
+    ui_fill_box(UIHudOverlay.x,UIHudOverlay.y,UI_HUD_W,UI_HUD_H,0,0);
+    ui_set_target(NULL);
+}
+
+// Called after perf_frame_done() at every frame while the HUD is active,
+// with the T-states executed by the frame.
+void hud_frame(uint32_t tstates) {
+    Hud.tstates += tstates;
+    Hud.exec_us += Perf.frame[PERF_EXEC];
+    Hud.decode_cyc += Perf.frame[PERF_DECODE];
+    Hud.display_cyc += Perf.frame[PERF_CONVERT]+Perf.frame[PERF_XFER];
+    if ((uint64_t)Perf.frame[PERF_FRAME]*ZX_CPU_HZ > (uint64_t)tstates*1000000)
+        Hud.late++;
+    Hud.frames++;
+
+    uint32_t now = time_us_32();
+    uint32_t elapsed = now-Hud.last_update;
+    if (elapsed < HUD_UPDATE_USEC) return;
+
+    // Times per frame in tenths of millisecond.
+    uint32_t khz = clock_get_hz(clk_sys)/1000;
+    uint32_t f = Hud.frames;
+    uint32_t speed = Hud.tstates*100*1000000/((uint64_t)elapsed*ZX_CPU_HZ);
+    uint32_t exec = Hud.exec_us/f/100;
+    uint32_t decode = Hud.decode_cyc*10/khz/f;
+    uint32_t display = Hud.display_cyc*10/khz/f;
+    uint32_t underruns = EMU.audio_underruns-Hud.underruns;
+
+    // Clamp to the columns available.
+    if (speed > 999) speed = 999;
+    if (khz > 999999) khz = 999999;
+    if (exec > 9999) exec = 9999;
+    if (decode > 9999) decode = 9999;
+    if (display > 9999) display = 9999;
+
+    char text[HUD_LINES][HUD_COLS+1];
+    snprintf(text[0],sizeof(text[0]),"%3u%% %3uMhz",speed,khz/1000);
+    snprintf(text[1],sizeof(text[1]),"z80  %3u.%ums",exec/10,exec%10);
+#if ZX_PERF_SUBSYSTEMS
+    snprintf(text[2],sizeof(text[2]),"dec  %3u.%ums",decode/10,decode%10);
+#else
+    (void)decode;
+    snprintf(text[2],sizeof(text[2]),"dec     n/a");
+#endif
+    snprintf(text[3],sizeof(text[3]),"disp %3u.%ums",display/10,display%10);
+    snprintf(text[4],sizeof(text[4]),"late%3u aud%2u",
+        Hud.late > 999 ? 999 : Hud.late, underruns > 99 ? 99 : underruns);
+
+    ui_set_target(&UIHudOverlay);
+    for (int j = 0; j < HUD_LINES; j++) {
+        if (!strcmp(text[j],Hud.text[j])) continue;
+        int y = UIHudOverlay.y+2+j*8;
+        ui_fill_box(UIHudOverlay.x+2,y,HUD_COLS*8,8,0,0);
+        ui_draw_string(UIHudOverlay.x+2,y,text[j],j == 0 ? 5 : 7,1);
+        memcpy(Hud.text[j],text[j],sizeof(text[j]));
+    }
+    ui_set_target(NULL);
+    UIHudOverlay.visible = 1;
+
+    Hud.tstates = Hud.exec_us = Hud.decode_cyc = Hud.display_cyc = 0;
+    Hud.frames = Hud.late = 0;
+    Hud.last_update = now;
+    Hud.underruns += underruns;
+}
+
+/* ============================== Benchmark mode ============================
+ * Started holding the fire button at power up. Every game of the catalog
+ * runs for BENCH_FRAMES frames three times: with the display transfer
+ * (like when playing), without it (emulation alone), and without it but
+ * with the audio playback running on core 1. Then a game runs at
+ * increasing clocks to find the maximum one producing the same frames
+ * as the base clock. Results are shown on the display and printed on
+ * the USB serial, so that every unit (Pico + panel) can be qualified. */
+
+#define BENCH_FRAMES 200
+#define BENCH_CLOCK_FRAMES 100
+#define BENCH_CLOCK_MIN 300000
+#define BENCH_CLOCK_MAX 450000
+#define BENCH_CLOCK_STEP 10000
+
+#define BENCH_DISPLAY 0         // Emulation + display transfer.
+#define BENCH_EMULATION 1       // Emulation alone.
+#define BENCH_AUDIO 2           // Emulation + audio playback.
+#define BENCH_PHASES 3
+
+struct bench_result {
+    uint32_t speed[BENCH_PHASES];   // Emulated speed, percentage.
+    uint32_t display_us;            // update_display() time per frame.
+};
+
+// Hash of the Spectrum framebuffer, to compare runs at different clocks.
+uint32_t bench_fb_hash(void) {
+    uint32_t h = 2166136261u;   // FNV-1a.
+    for (uint32_t j = 0; j < ZX_FRAMEBUFFER_SIZE_BYTES; j++)
+        h = (h ^ EMU.zx.fb[j]) * 16777619u;
+    return h;
+}
+
+// Load 'game_id' and run it for 'frames' frames, handling just the key
+// macros, so that the run is deterministic. Returns the emulated speed
+// in percentage of the real Spectrum, and the average update_display()
+// time in '*display_us' if 'display' is true.
+uint32_t bench_run(int game_id, uint32_t frames, int display,
+                   uint32_t *display_us)
+{
+    uint64_t tstates = 0, display_time = 0;
+    zx_reset(&EMU.zx); // Don't inherit scanline / blink counters.
+    load_game(game_id);
+    uint64_t start = time_us_64();
+    for (EMU.tick = 0; EMU.tick < frames; EMU.tick++) {
+        handle_zx_key_press(&EMU.zx, EMU.current_keymap, &EMU.macros,
+                            EMU.tick, HANDLE_KEYPRESS_MACRO);
+        tstates += zx_exec(&EMU.zx, FRAME_USEC);
+        if (display) {
+            uint64_t t = time_us_64();
+            update_display(EMU.scaling,EMU.show_border);
+            display_time += time_us_64()-t;
+        }
+    }
+    uint64_t elapsed = time_us_64()-start;
+    if (display_us) *display_us = display_time/frames;
+    return tstates*100*1000000/(elapsed*ZX_CPU_HZ);
+}
+
+// Show the benchmark progress or results, one string per line, on the
+// display.
+void bench_show(const char **lines) {
+    memset(EMU.zx.fb,0,ZX_FRAMEBUFFER_SIZE_BYTES);
+    for (int j = 0; lines[j]; j++)
+        ui_draw_string(10,10+j*10,lines[j],7,1);
+    update_display(EMU.scaling,EMU.show_border);
+}
+
+// Run the benchmark and show the results until a button is pressed.
+// Core 1 must not be running yet: it is started here for the audio
+// phase and left running.
+void run_benchmark(void) {
+    static char text[24][32];
+    const char *lines[25];
+    static struct bench_result res[24];
+    uint32_t games = GamesTableSize < 20 ? GamesTableSize : 20;
+
+    // Wait for the fire button to be released, otherwise it would be
+    // seen as an input of the first game.
+    while (get_device_button(KEY_FIRE)) sleep_ms(10);
+    printf("bench: game,display%%,emulation%%,audio%%,display_us\n");
+
+    for (int phase = 0; phase < BENCH_PHASES; phase++) {
+        if (phase == BENCH_AUDIO && SPEAKER_PIN != -1)
+            multicore_launch_core1(core1_play_audio);
+        for (uint32_t g = 0; g < games; g++) {
+            snprintf(text[0],sizeof(text[0]),"Benchmark %d/%d",
+                     phase+1,BENCH_PHASES);
+            lines[0] = text[0];
+            lines[1] = GamesTable[g].name;
+            lines[2] = NULL;
+            bench_show(lines);
+            res[g].speed[phase] = bench_run(g,BENCH_FRAMES,
+                phase == BENCH_DISPLAY, phase == BENCH_DISPLAY ?
+                &res[g].display_us : NULL);
+        }
+    }
+
+    for (uint32_t g = 0; g < games; g++) {
+        printf("bench: %s,%u,%u,%u,%u\n", GamesTable[g].name,
+            res[g].speed[BENCH_DISPLAY], res[g].speed[BENCH_EMULATION],
+            res[g].speed[BENCH_AUDIO], res[g].display_us);
+        // Clamp to the columns of the table.
+        uint32_t speed[BENCH_PHASES];
+        for (int phase = 0; phase < BENCH_PHASES; phase++)
+            speed[phase] = res[g].speed[phase] > 9999 ?
+                           9999 : res[g].speed[phase];
+        uint32_t display_us = res[g].display_us > 999999 ?
+                              999999 : res[g].display_us;
+        snprintf(text[g+1],sizeof(text[0]),"%-10.10s%4u%%%4u%%%4u%%%3u.%u",
+            GamesTable[g].name,
+            speed[BENCH_DISPLAY], speed[BENCH_EMULATION],
+            speed[BENCH_AUDIO], display_us/1000, display_us%1000/100);
+    }
+
+    // Max stable clock: the frames produced by the first game at every
+    // clock must be the same as the ones at the base clock. A unit that
+    // is really unstable may just hang: the clock being tested is printed
+    // before the test, so the last one reported is the culprit.
+    uint32_t emu_clock = EMU.emu_clock, stable = 0;
+    if (games) {
+        EMU.emu_clock = EMU.base_clock;
+        bench_run(0,BENCH_CLOCK_FRAMES,1,NULL);
+        uint32_t expected = bench_fb_hash();
+        for (uint32_t khz = BENCH_CLOCK_MIN; khz <= BENCH_CLOCK_MAX;
+             khz += BENCH_CLOCK_STEP)
+        {
+            uint vco, postdiv1, postdiv2;
+            if (!check_sys_clock_khz(khz,&vco,&postdiv1,&postdiv2)) continue;
+            printf("bench: testing clock %u khz\n", khz);
+            snprintf(text[0],sizeof(text[0]),"Clock %u Mhz",khz/1000);
+            lines[0] = text[0];
+            lines[1] = NULL;
+            bench_show(lines);
+            EMU.emu_clock = khz;
+            bench_run(0,BENCH_CLOCK_FRAMES,1,NULL);
+            if (bench_fb_hash() != expected) break;
+            stable = khz;
+        }
+        EMU.emu_clock = emu_clock;
+        set_sys_clock_khz(EMU.emu_clock, false);
+    }
+    printf("bench: max stable clock %u khz\n", stable);
+
+    snprintf(text[0],sizeof(text[0]),"Game       disp emul  aud  ms");
+    snprintf(text[games+1],sizeof(text[0]),"Max clock %u Mhz",stable/1000);
+    for (uint32_t j = 0; j <= games+1; j++) lines[j] = text[j];
+    lines[games+2] = NULL;
+    bench_show(lines);
+
+    while (!get_device_button(KEY_FIRE)) sleep_ms(10);
+    while (get_device_button(KEY_FIRE)) sleep_ms(10);
+    memset(EMU.zx.fb,0,ZX_FRAMEBUFFER_SIZE_BYTES);
+}
+
+// The host benchmarks include this file and provide their own main().
+#ifndef ZX_NO_MAIN
 int main() {
     init_emulator();
     st77xx_fill(0);
+    if (EMU.benchmark) run_benchmark();
     load_game(EMU.selected_game);
 
-    if (SPEAKER_PIN != -1) multicore_launch_core1(core1_play_audio);
+    if (SPEAKER_PIN != -1 && !EMU.benchmark)
+        multicore_launch_core1(core1_play_audio);
+    watchdog_start(SPEAKER_PIN != -1); // Core 1 runs after the benchmark too.
 
     while (true) {
-        absolute_time_t start, zx_exec_time, update_time;
+        perf_us_begin(PERF_FRAME);
 
         // Handle key presses on the phisical device. Either translate
         // them to Spectrum keypresses, or if the user interface is
@@ -785,17 +1853,27 @@ int main() {
         int kflags = HANDLE_KEYPRESS_ALL;
         if (EMU.menu_active || EMU.tick < EMU.menu_left_at_tick+10)
             kflags = HANDLE_KEYPRESS_MACRO;
-        handle_zx_key_press(&EMU.zx, EMU.current_keymap, EMU.tick, kflags);
+        perf_cycles_begin(PERF_KEYS);
+        handle_zx_key_press(&EMU.zx, EMU.current_keymap, &EMU.macros,
+                            EMU.tick, kflags);
+        perf_cycles_end(PERF_KEYS);
 
         // Run the Spectrum VM for a few ticks.
-        start = get_absolute_time();
-        zx_exec(&EMU.zx, FRAME_USEC);
-        zx_exec_time = get_absolute_time()-start;
-
-        // Handle the menu.
+        perf_us_begin(PERF_EXEC);
+        uint32_t tstates = zx_exec(&EMU.zx, FRAME_USEC);
+        perf_us_end(PERF_EXEC);
+#if ZX_DEBUGGER
+        // zx_exec() returns at once while stopped, so only the call
+        // that stopped executed something.
+        if (EMU.zx.debug.stop && tstates) debug_print_stop();
+#endif
+
+        // Handle the menu. It is drawn into its overlays only when
+        // something changed, and merged by update_display().
         if (EMU.menu_active) {
             ui_draw_menu();
         }
+        ui_show_menu(EMU.menu_active);
 
         // In debug mode, show the frame number. Useful in order to
         // find the right timing for automatic key presses.
@@ -807,14 +1885,22 @@ int main() {
         }
 
         // Update the display with the current CRT image.
-        start = get_absolute_time();
-        update_display(EMU.scaling,EMU.show_border);
-        update_time = get_absolute_time()-start;
-
-        EMU.tick++;
-        printf("display: %llu us, zx(%u): %llu us, FPS: %.1f\n",
-            update_time,
-            FRAME_USEC, zx_exec_time,
-            1000000.0/(float)(zx_exec_time+update_time));
+        uint32_t display_bytes = update_display(EMU.scaling,EMU.show_border);
+        perf_us_end(PERF_FRAME);
+
+        // Report the performance counters, as text or telemetry records.
+        // When telemetry is on, the text report is only printed on demand.
+        int report_due = perf_frame_done();
+        if (EMU.hud_active) hud_frame(tstates);
+        if (Telemetry.enabled) {
+            queue_frame_telemetry(tstates,display_bytes);
+            telemetry_drain();
+        } else if (report_due) {
+            perf_report();
+        }
+        handle_serial_commands();
+        watchdog_heartbeat(0,tstates != 0);
+        if (tstates) EMU.tick++; // Not while stopped by the debugger.
     }
 }
+#endif
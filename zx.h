@@ -18,6 +18,15 @@
     ~~~
         your own assert macro (default: assert(c))
 
+    ~~~C
+    ZX_PROFILE_BEGIN(what)
+    ZX_PROFILE_END(what)
+    ~~~
+        profiling hooks around the emulator subsystems, where 'what'
+        is one of ZX_PROF_DECODE (video decoding), ZX_PROF_AUDIO (beeper
+        sampling) or ZX_PROF_KBD (keyboard handling). The time not
+        spent in these is the CPU emulation itself (default: empty)
+
     You need to include the following headers before including zx.h:
 
     - chips/chips_common.h
@@ -69,7 +78,7 @@ extern "C" {
 #endif
 
 // bump this whenever the zx_t struct layout changes
-#define ZX_SNAPSHOT_VERSION (0x0001)
+#define ZX_SNAPSHOT_VERSION (0x0002)
 
 #define ZX_FRAMEBUFFER_WIDTH (320/2) // 4 bits per pixel.
 #define ZX_FRAMEBUFFER_HEIGHT (256)
@@ -90,6 +99,12 @@ typedef enum {
     ZX_JOYSTICKTYPE_SINCLAIR_2,
 } zx_joystick_type_t;
 
+// subsystems for ZX_PROFILE_BEGIN() / ZX_PROFILE_END()
+#define ZX_PROF_DECODE      0
+#define ZX_PROF_AUDIO       1
+#define ZX_PROF_KBD         2
+#define ZX_PROF_COUNT       3
+
 // joystick mask bits
 #define ZX_JOYSTICK_RIGHT   (1<<0)
 #define ZX_JOYSTICK_LEFT    (1<<1)
@@ -108,8 +123,76 @@ typedef struct {
     } roms;
 } zx_desc_t;
 
-// ZX emulator state
+typedef struct zx_t zx_t;
+
+// I/O port handlers, see zx_io_register(). The handler gets the pins of
+// the I/O request, and returns them, with the data bus set for reads.
+typedef uint64_t (*zx_io_handler_t)(zx_t* sys, uint64_t pins);
+
+#define ZX_IO_RD            (1<<0)  // Handler for IN.
+#define ZX_IO_WR            (1<<1)  // Handler for OUT.
+#define ZX_IO_MAX_HANDLERS  8
+
 typedef struct {
+    uint16_t mask;          // Address lines decoded by the device.
+    uint16_t port;          // Value of the decoded lines.
+    uint8_t dir;            // ZX_IO_RD, ZX_IO_WR or both.
+    zx_io_handler_t handler;
+} zx_io_port_t;
+
+// Hypercall port, see zx_hypercall_enable(). The guest issues a hypercall
+// with OUT (C),A: BC = ZX_HCALL_PORT, A = command, arguments in HL and DE.
+// Reading the port returns ZX_HCALL_MAGIC if hypercalls are enabled.
+#define ZX_HCALL_PORT       0x5ABB  // Fully decoded, used by no device.
+#define ZX_HCALL_MAGIC      0x5A
+#define ZX_HCALL_BEGIN      1       // Start of the region HL.
+#define ZX_HCALL_END        2       // End of the region HL.
+#define ZX_HCALL_COUNTER    3       // Counter DE has the value HL.
+#define ZX_HCALL_SNAPSHOT   4       // Snapshot requested, tag HL.
+
+typedef void (*zx_hypercall_t)(zx_t* sys, uint8_t cmd, uint16_t hl, uint16_t de);
+
+// Debugger: PC breakpoints and memory watchpoints, see zx_debug_break()
+// and zx_debug_watch(). Only compiled in with ZX_DEBUGGER=1, and even
+// then zx_exec() runs the normal loop unless something is set: the
+// checks live in a second copy of the loop, selected once per call.
+#ifndef ZX_DEBUGGER
+#define ZX_DEBUGGER 0
+#endif
+
+#define ZX_DEBUG_MAX_WATCH  8
+
+// Why zx_exec() stopped, see zx_t debug.stop.
+#define ZX_DEBUG_RUNNING    0
+#define ZX_DEBUG_BREAK      1   // Opcode fetch at a breakpoint.
+#define ZX_DEBUG_READ       2   // Read of a watched address.
+#define ZX_DEBUG_WRITE      3   // Write of a watched address.
+#define ZX_DEBUG_STEP       4   // Next opcode fetch after zx_debug_step().
+
+typedef struct {
+    uint16_t addr;          // First watched address.
+    uint16_t len;           // Watched bytes.
+    uint8_t dir;            // ZX_IO_RD, ZX_IO_WR or both.
+} zx_watch_t;
+
+typedef struct {
+    bool active;            // Anything set: run the checking loop.
+    bool step;              // Stop at the next opcode fetch.
+    uint32_t breakpoints;   // Bits set in pc_break[].
+    uint8_t pc_break[8192]; // One bit per address.
+    uint64_t watch_rd;      // Pages (1KB, as in mem_t) with a read watch.
+    uint64_t watch_wr;      // Pages with a write watch.
+    uint32_t watches;       // Entries of watch[].
+    zx_watch_t watch[ZX_DEBUG_MAX_WATCH];
+    // Set when zx_exec() stops. zx_exec() returns at once until
+    // zx_debug_continue() or zx_debug_step() is called.
+    int stop;               // ZX_DEBUG_*.
+    uint16_t stop_addr;     // Address of the fetch or access.
+    uint8_t stop_data;      // Byte read or written.
+} zx_debug_t;
+
+// ZX emulator state
+struct zx_t {
     z80_t cpu;
     zx_type_t type;
     zx_joystick_type_t joystick_type;
@@ -139,6 +222,19 @@ typedef struct {
     absolute_time_t audiobuf_start_t;   // Time when the first sample was set.
 
     int int_counter;
+
+    // I/O dispatch. For every value of the port low byte, io_rd[] and
+    // io_wr[] hold the index+1 of the first handler in io_port[] that
+    // decodes it, or 0 if there is none.
+    uint8_t io_rd[256];
+    uint8_t io_wr[256];
+    uint32_t io_ports;                          // Handlers in io_port[].
+    zx_io_port_t io_port[ZX_IO_MAX_HANDLERS];   // In registration order.
+    zx_hypercall_t hypercall;   // Set by zx_hypercall_enable().
+#if ZX_DEBUGGER
+    zx_debug_t debug;
+#endif
+
     uint32_t display_ram_bank;
     kbd_t kbd;
     mem_t mem;
@@ -149,7 +245,7 @@ typedef struct {
     uint8_t rom[2][0x4000];
     uint8_t junk[0x4000];
     alignas(64) uint8_t fb[ZX_FRAMEBUFFER_SIZE_BYTES];
-} zx_t;
+};
 
 // initialize a new ZX Spectrum instance
 void zx_init(zx_t* sys, const zx_desc_t* desc);
@@ -171,6 +267,30 @@ void zx_set_joystick_type(zx_t* sys, zx_joystick_type_t type);
 zx_joystick_type_t zx_joystick_type(zx_t* sys);
 // set joystick mask (combination of ZX_JOYSTICK_*)
 void zx_joystick(zx_t* sys, uint8_t mask);
+// register an I/O port handler for the ports with (addr & mask) == port,
+// for reads and/or writes (ZX_IO_RD / ZX_IO_WR): handlers registered first
+// win. Returns false if there is no room for more handlers.
+bool zx_io_register(zx_t* sys, uint16_t mask, uint16_t port, uint8_t dir, zx_io_handler_t handler);
+// enable the hypercall port (ZX_HCALL_PORT): 'fn' is called for every
+// hypercall of the guest. Unless enabled, the port does not exist.
+bool zx_hypercall_enable(zx_t* sys, zx_hypercall_t fn);
+#if ZX_DEBUGGER
+// set or clear the breakpoint at 'addr': zx_exec() stops at the opcode
+// fetch of the instruction there, see zx_debug_t.
+void zx_debug_break(zx_t* sys, uint16_t addr, bool set);
+// watch 'len' bytes from 'addr' for reads and/or writes (ZX_IO_RD /
+// ZX_IO_WR): zx_exec() stops right after the access. Opcode fetches are
+// not reads here, use breakpoints. Returns false if there is no room.
+bool zx_debug_watch(zx_t* sys, uint16_t addr, uint16_t len, uint8_t dir);
+// remove the watchpoints starting at 'addr'
+void zx_debug_unwatch(zx_t* sys, uint16_t addr);
+// remove all the breakpoints and watchpoints
+void zx_debug_clear(zx_t* sys);
+// resume the execution after a stop
+void zx_debug_continue(zx_t* sys);
+// resume the execution, and stop at the next opcode fetch
+void zx_debug_step(zx_t* sys);
+#endif
 // load a ZX Z80 file into the emulator
 bool zx_quickload(zx_t* sys, chips_range_t data);
 // save a snapshot, patches any pointers to zero, returns a snapshot version
@@ -189,9 +309,14 @@ bool zx_load_snapshot(zx_t* sys, uint32_t version, zx_t* src);
     #include <assert.h>
     #define CHIPS_ASSERT(c) assert(c)
 #endif
+#ifndef ZX_PROFILE_BEGIN
+    #define ZX_PROFILE_BEGIN(what)
+    #define ZX_PROFILE_END(what)
+#endif
 
 static void _zx_init_memory_map(zx_t* sys);
 static void _zx_init_keyboard_matrix(zx_t* sys);
+static void _zx_init_io(zx_t* sys);
 
 #define _ZX_DEFAULT(val,def) (((val) != 0) ? (val) : (def))
 
@@ -220,6 +345,7 @@ void zx_init(zx_t* sys, const zx_desc_t* desc) {
 
     _zx_init_memory_map(sys);
     _zx_init_keyboard_matrix(sys);
+    _zx_init_io(sys);
 
     // Audio initialization
     memset(sys->audiobuf,0,sizeof(sys->audiobuf));
@@ -339,28 +465,123 @@ static bool _zx_decode_scanline(zx_t* sys) {
     }
 }
 
-static uint64_t _zx_tick(zx_t* sys, uint64_t pins) {
-    pins = z80_tick(&sys->cpu, &sys->mem, pins);
-
-    // video decoding and vblank interrupt
-    if (--sys->scanline_counter <= 0) {
-        sys->scanline_counter += sys->scanline_period;
-        // decode next video scanline
-        if (_zx_decode_scanline(sys)) {
-            // request vblank interrupt
-            pins |= Z80_INT;
-            // hold the INT pin for 32 ticks
-            sys->int_counter = 32;
+// Spectrum ULA (...............0)
+static uint64_t _zx_ula_io(zx_t* sys, uint64_t pins) {
+    /* Bits 5 and 7 as read by INning from Port 0xfe are always one */
+    if (pins & Z80_RD) {
+        // read from ULA
+        uint8_t data = (1<<7)|(1<<5);
+        // MIC/EAR flags -> bit 6
+        if (sys->last_fe_out & (1<<3|1<<4)) {
+            data |= (1<<6);
         }
+        // keyboard matrix bits are encoded in the upper 8 bit of the port address
+        ZX_PROFILE_BEGIN(ZX_PROF_KBD);
+        uint16_t column_mask = (~(Z80_GET_ADDR(pins)>>8)) & 0x00FF;
+        const uint16_t kbd_lines = kbd_test_lines(&sys->kbd, column_mask);
+        ZX_PROFILE_END(ZX_PROF_KBD);
+        data |= (~kbd_lines) & 0x1F;
+        Z80_SET_DATA(pins, data);
+    }
+    else {
+        // write to ULA
+        // FIXME: bit 3: MIC output (CAS SAVE, 0=On, 1=Off)
+        const uint8_t data = Z80_GET_DATA(pins);
+        sys->border_color = data & 7;
+        sys->last_fe_out = data;
+
+        // Replicate the Z80 audio pin status on the global state
+        // so we can sample it at regular intervals.
+        sys->beeper_state = 0 != (data & (1<<4));
     }
+    return pins;
+}
 
-    // clear INT pin after 32 ticks
-    if (pins & Z80_INT) {
-        if (--sys->int_counter < 0) {
-            pins &= ~Z80_INT;
-        }
+// Kempston Joystick (........000.....)
+static uint64_t _zx_kempston_in(zx_t* sys, uint64_t pins) {
+    Z80_SET_DATA(pins, sys->kbd_joymask | sys->joy_joymask);
+    return pins;
+}
+
+static void _zx_init_io(zx_t* sys) {
+    // The ULA answers all the even ports, so the Kempston interface,
+    // registered after it, only the odd ones.
+    zx_io_register(sys, 0x0001, 0x0000, ZX_IO_RD|ZX_IO_WR, _zx_ula_io);
+    zx_io_register(sys, 0x00E0, 0x0000, ZX_IO_RD, _zx_kempston_in);
+}
+
+bool zx_io_register(zx_t* sys, uint16_t mask, uint16_t port, uint8_t dir, zx_io_handler_t handler) {
+    CHIPS_ASSERT(sys && handler);
+    if (sys->io_ports == ZX_IO_MAX_HANDLERS) return false;
+    zx_io_port_t* p = &sys->io_port[sys->io_ports++];
+    p->mask = mask;
+    p->port = port & mask;
+    p->dir = dir;
+    p->handler = handler;
+
+    // Fill the entries of the low bytes this handler decodes that are
+    // still free: earlier handlers take precedence.
+    for (uint32_t lo = 0; lo < 256; lo++) {
+        if ((lo & mask & 0xFF) != (p->port & 0xFF)) continue;
+        if ((dir & ZX_IO_RD) && !sys->io_rd[lo]) sys->io_rd[lo] = sys->io_ports;
+        if ((dir & ZX_IO_WR) && !sys->io_wr[lo]) sys->io_wr[lo] = sys->io_ports;
+    }
+    return true;
+}
+
+static uint64_t _zx_hypercall_io(zx_t* sys, uint64_t pins) {
+    if (pins & Z80_RD) {
+        Z80_SET_DATA(pins, ZX_HCALL_MAGIC);
+    }
+    else {
+        sys->hypercall(sys, Z80_GET_DATA(pins), sys->cpu.hl, sys->cpu.de);
+    }
+    return pins;
+}
+
+bool zx_hypercall_enable(zx_t* sys, zx_hypercall_t fn) {
+    CHIPS_ASSERT(sys && fn);
+    if (sys->hypercall) {
+        sys->hypercall = fn;
+        return true;
+    }
+    if (!zx_io_register(sys, 0xFFFF, ZX_HCALL_PORT, ZX_IO_RD|ZX_IO_WR, _zx_hypercall_io))
+        return false;
+    sys->hypercall = fn;
+    return true;
+}
+
+// Dispatch an I/O request to its handler. The low byte of the port
+// selects the first candidate handler; only if it also decodes the high
+// byte, and that does not match, the handlers registered after it are
+// checked in order.
+static uint64_t _zx_io(zx_t* sys, uint64_t pins) {
+    uint8_t dir;
+    const uint8_t* table;
+    if (pins & Z80_RD) {
+        dir = ZX_IO_RD;
+        table = sys->io_rd;
+    }
+    else if (pins & Z80_WR) {
+        dir = ZX_IO_WR;
+        table = sys->io_wr;
+    }
+    else {
+        return pins;    // Interrupt acknowledge.
+    }
+
+    const uint16_t addr = Z80_GET_ADDR(pins);
+    for (uint32_t j = table[addr & 0xFF]; j && j <= sys->io_ports; j++) {
+        const zx_io_port_t* p = &sys->io_port[j-1];
+        if ((p->dir & dir) && (addr & p->mask) == p->port)
+            return p->handler(sys, pins);
     }
+    return pins;
+}
 
+// Memory and I/O requests of the CPU. z80_tick() returns to us for
+// every request, so memory is serviced here too.
+static uint64_t _zx_mem_io(zx_t* sys, uint64_t pins) {
     if (pins & Z80_MREQ) {
         // a memory request
         // FIXME: 'contended memory'
@@ -373,87 +594,283 @@ static uint64_t _zx_tick(zx_t* sys, uint64_t pins) {
         }
     }
     else if (pins & Z80_IORQ) {
-        if ((pins & Z80_A0) == 0) {
-            /* Spectrum ULA (...............0)
-                Bits 5 and 7 as read by INning from Port 0xfe are always one
-            */
-            if (pins & Z80_RD) {
-                // read from ULA
-                uint8_t data = (1<<7)|(1<<5);
-                // MIC/EAR flags -> bit 6
-                if (sys->last_fe_out & (1<<3|1<<4)) {
-                    data |= (1<<6);
-                }
-                // keyboard matrix bits are encoded in the upper 8 bit of the port address
-                uint16_t column_mask = (~(Z80_GET_ADDR(pins)>>8)) & 0x00FF;
-                const uint16_t kbd_lines = kbd_test_lines(&sys->kbd, column_mask);
-                data |= (~kbd_lines) & 0x1F;
-                Z80_SET_DATA(pins, data);
-            }
-            else if (pins & Z80_WR) {
-                // write to ULA
-                // FIXME: bit 3: MIC output (CAS SAVE, 0=On, 1=Off)
-                const uint8_t data = Z80_GET_DATA(pins);
-                sys->border_color = data & 7;
-                sys->last_fe_out = data;
-
-                // Replicate the Z80 audio pin status on the global state
-                // so we can sample it at regular intervals.
-                sys->beeper_state = 0 != (data & (1<<4));
-            }
+        pins = _zx_io(sys, pins);
+    }
+    return pins;
+}
+
+/* ULA events scheduler.
+ *
+ * Instead of updating the scanline and INT counters at every tick,
+ * zx_exec() keeps the deadline of every event, in ticks from the start of
+ * the call, and only compares the current tick with the nearest one. Due
+ * events run in the order of the per-tick code they replace: scanline
+ * decoding and INT before the memory or I/O request of the tick
+ * (_zx_events()), audio sampling after it (_zx_late_events()). The
+ * counters in zx_t are only converted to deadlines and back at the start
+ * and the end of zx_exec(), so the emulation is the same, and so are the
+ * snapshots. */
+#define ZX_EVENT_SCANLINE   0   // Decode the next scanline, vblank INT.
+#define ZX_EVENT_INT_END    1   // Release the INT pin.
+#define ZX_EVENT_AUDIO      2   // Sample the beeper into audiobuf.
+#define ZX_EVENT_COUNT      3
+#define ZX_EVENT_NEVER      UINT32_MAX
+
+#define ZX_INT_TICKS        32  // INT is held for 32 ticks.
+#define ZX_AUDIO_PERIOD     16  // Ticks between audio samples.
+
+// Return the deadline of the nearest event in 'at'.
+static uint32_t _zx_next_event(const uint32_t* at) {
+    uint32_t next = at[0];
+    for (int j = 1; j < ZX_EVENT_COUNT; j++)
+        if (at[j] < next) next = at[j];
+    return next;
+}
+
+// Run the events due at 'tick' that come before the memory or I/O
+// request of the tick, rescheduling them in 'at'.
+static uint64_t _zx_events(zx_t* sys, uint64_t pins, uint32_t tick, uint32_t* at) {
+    if (at[ZX_EVENT_SCANLINE] == tick) {
+        at[ZX_EVENT_SCANLINE] += sys->scanline_period;
+        // decode next video scanline
+        ZX_PROFILE_BEGIN(ZX_PROF_DECODE);
+        bool vblank = _zx_decode_scanline(sys);
+        ZX_PROFILE_END(ZX_PROF_DECODE);
+        if (vblank) {
+            // request vblank interrupt
+            pins |= Z80_INT;
+            at[ZX_EVENT_INT_END] = tick + ZX_INT_TICKS;
         }
-        else if ((pins & (Z80_RD|Z80_A7|Z80_A6|Z80_A5)) == Z80_RD) {
-            // Kempston Joystick (........000.....)
-            Z80_SET_DATA(pins, sys->kbd_joymask | sys->joy_joymask);
+    }
+    if (at[ZX_EVENT_INT_END] == tick) {
+        pins &= ~Z80_INT;
+        sys->int_counter = -1;
+        at[ZX_EVENT_INT_END] = ZX_EVENT_NEVER;
+    }
+    return pins;
+}
+
+// Like _zx_events(), for the events that come after the request.
+static void _zx_late_events(zx_t* sys, uint32_t tick, uint32_t* at) {
+    if (at[ZX_EVENT_AUDIO] == tick) {
+        at[ZX_EVENT_AUDIO] += ZX_AUDIO_PERIOD;
+        ZX_PROFILE_BEGIN(ZX_PROF_AUDIO);
+        // Fill sample.
+        sys->audiobuf[sys->audiobuf_byte] &=
+            ~(((uint32_t)1)<<sys->audiobuf_bit);
+        sys->audiobuf[sys->audiobuf_byte] |=
+            sys->beeper_state<<sys->audiobuf_bit;
+
+        // Go to next byte/bit
+        sys->audiobuf_bit = (sys->audiobuf_bit+1) & 31; // Incr modulo 32.
+        if (sys->audiobuf_bit == 0)
+            sys->audiobuf_byte = (sys->audiobuf_byte+1) & (AUDIOBUF_LEN-1);
+
+        // Buffer full (back to zero after increment)? Set the timestamp
+        // and ping the other thread that plays the samples.
+        if ((sys->audiobuf_byte == 0 ||
+             sys->audiobuf_byte == AUDIOBUF_LEN/2) &&
+             sys->audiobuf_bit == 0)
+        {
+            // audiobuf_notify will be cleared by other thread.
+            sys->audiobuf_notify = sys->audiobuf_byte == 0 ? 2 : 1;
         }
+        ZX_PROFILE_END(ZX_PROF_AUDIO);
     }
+}
 
-    return pins;
+#if ZX_DEBUGGER
+// Check the memory request in 'pins', already serviced, against the
+// breakpoints and the watchpoints. Returns true, with the reason in
+// debug.stop, if zx_exec() must stop.
+static bool _zx_debug_check(zx_t* sys, uint64_t pins) {
+    zx_debug_t* dbg = &sys->debug;
+    const uint16_t addr = Z80_GET_ADDR(pins);
+    int stop = ZX_DEBUG_RUNNING;
+    if (pins & Z80_M1) {
+        // Opcode fetch. The second one of prefixed instructions is not
+        // the start of an instruction.
+        if (sys->cpu.prefix_active)
+            return false;
+        if (dbg->step)
+            stop = ZX_DEBUG_STEP;
+        else if (dbg->pc_break[addr>>3] & (1<<(addr&7)))
+            stop = ZX_DEBUG_BREAK;
+    }
+    else if (pins & (Z80_RD|Z80_WR)) {
+        const uint8_t dir = (pins & Z80_RD) ? ZX_IO_RD : ZX_IO_WR;
+        const uint64_t pages = (dir == ZX_IO_RD) ? dbg->watch_rd : dbg->watch_wr;
+        if (!(pages & (1ULL<<(addr>>MEM_PAGE_SHIFT))))
+            return false;
+        for (uint32_t j = 0; j < dbg->watches; j++) {
+            const zx_watch_t* w = &dbg->watch[j];
+            if ((w->dir & dir) && (uint16_t)(addr - w->addr) < w->len) {
+                stop = (dir == ZX_IO_RD) ? ZX_DEBUG_READ : ZX_DEBUG_WRITE;
+                break;
+            }
+        }
+    }
+    if (stop == ZX_DEBUG_RUNNING)
+        return false;
+    dbg->stop = stop;
+    dbg->stop_addr = addr;
+    dbg->stop_data = Z80_GET_DATA(pins);
+    dbg->step = false;
+    return true;
 }
+#endif
 
-uint32_t zx_exec(zx_t* sys, uint32_t micro_seconds) {
-    CHIPS_ASSERT(sys && sys->valid);
+// The body of zx_exec(). It is always inlined, with 'debug' constant, so
+// that the normal loop has no trace of the debugger checks: when 'debug'
+// is set, the loop stops after the request that hit a breakpoint or a
+// watchpoint. Returns the ticks executed.
+static inline __attribute__((always_inline))
+uint32_t _zx_exec(zx_t* sys, uint32_t micro_seconds, const bool debug) {
     const uint32_t num_ticks = clk_us_to_ticks(sys->freq_hz, micro_seconds);
     uint64_t pins = sys->pins;
-    for (uint32_t tick = 0; tick < num_ticks; tick++) {
-        pins = _zx_tick(sys, pins);
-        #if 0
-        // If we run for enough ticks and the refresh is near the end,
-        // we can do an early break to refresh the screen once a new image
-        // is available. However, is this useful? Most programs will just
-        // write on the VMEM at random times I guess.
-        if (num_ticks-tick < tick/8 && sys->scanline_y > 290) break;
-        #endif
-
-        // Audio buffer handling.
-        if (SPEAKER_PIN != -1 && !(tick & 0xf)) {
-            // Fill sample.
-            sys->audiobuf[sys->audiobuf_byte] &=
-                ~(((uint32_t)1)<<sys->audiobuf_bit);
-            sys->audiobuf[sys->audiobuf_byte] |=
-                sys->beeper_state<<sys->audiobuf_bit;
-
-            // Go to next byte/bit
-            sys->audiobuf_bit = (sys->audiobuf_bit+1) & 31; // Incr modulo 32.
-            if (sys->audiobuf_bit == 0)
-                sys->audiobuf_byte = (sys->audiobuf_byte+1) & (AUDIOBUF_LEN-1);
-
-            // Buffer full (back to zero after increment)? Set the timestamp
-            // and ping the other thread that plays the samples.
-            if ((sys->audiobuf_byte == 0 ||
-                 sys->audiobuf_byte == AUDIOBUF_LEN/2) &&
-                 sys->audiobuf_bit == 0)
-            {
-                // audiobuf_notify will be cleared by other thread.
-                sys->audiobuf_notify = sys->audiobuf_byte == 0 ? 2 : 1;
-            }
+
+    // Deadlines from the counters left by the previous call. The counters
+    // are decremented at every tick, and the event fires when the scanline
+    // counter reaches zero, or the INT one goes below zero.
+    uint32_t at[ZX_EVENT_COUNT];
+    at[ZX_EVENT_SCANLINE] = sys->scanline_counter > 0 ?
+                            sys->scanline_counter-1 : 0;
+    at[ZX_EVENT_INT_END] = !(pins & Z80_INT) ? ZX_EVENT_NEVER :
+                           sys->int_counter > 0 ? sys->int_counter : 0;
+    at[ZX_EVENT_AUDIO] = SPEAKER_PIN != -1 ? 0 : ZX_EVENT_NEVER;
+    uint32_t next = _zx_next_event(at);
+
+    uint32_t tick;
+    for (tick = 0; tick < num_ticks; tick++) {
+        pins = z80_tick(&sys->cpu, &sys->mem, pins);
+        const bool due = tick == next;
+        if (due) pins = _zx_events(sys, pins, tick, at);
+        if (pins & (Z80_MREQ|Z80_IORQ)) pins = _zx_mem_io(sys, pins);
+        if (due) {
+            _zx_late_events(sys, tick, at);
+            next = _zx_next_event(at);
+        }
+#if ZX_DEBUGGER
+        if (debug && (pins & Z80_MREQ) && _zx_debug_check(sys, pins)) {
+            tick++;
+            break;
         }
+#else
+        (void)debug;
+#endif
     }
+
+    // Back to counters for the next call.
+    sys->scanline_counter = at[ZX_EVENT_SCANLINE] - tick + 1;
+    if (pins & Z80_INT)
+        sys->int_counter = at[ZX_EVENT_INT_END] - tick;
     sys->pins = pins;
+    ZX_PROFILE_BEGIN(ZX_PROF_KBD);
     kbd_update(&sys->kbd, micro_seconds);
-    return num_ticks;
+    ZX_PROFILE_END(ZX_PROF_KBD);
+    return tick;
 }
 
+#if ZX_DEBUGGER
+// zx_exec() with breakpoints or watchpoints set, or stopped. Not hot:
+// it only runs while debugging.
+static uint32_t _zx_exec_debug(zx_t* sys, uint32_t micro_seconds) {
+    if (sys->debug.stop != ZX_DEBUG_RUNNING) return 0;
+    return _zx_exec(sys, micro_seconds, true);
+}
+#endif
+
+uint32_t zx_exec(zx_t* sys, uint32_t micro_seconds) {
+    CHIPS_ASSERT(sys && sys->valid);
+#if ZX_DEBUGGER
+    if (sys->debug.active) return _zx_exec_debug(sys, micro_seconds);
+#endif
+    return _zx_exec(sys, micro_seconds, false);
+}
+
+#if ZX_DEBUGGER
+// Recompute the watched pages and whether zx_exec() must run the
+// checking loop.
+static void _zx_debug_update(zx_t* sys) {
+    zx_debug_t* dbg = &sys->debug;
+    dbg->watch_rd = dbg->watch_wr = 0;
+    for (uint32_t j = 0; j < dbg->watches; j++) {
+        const zx_watch_t* w = &dbg->watch[j];
+        for (uint32_t a = 0; a < w->len; a += MEM_PAGE_SIZE) {
+            const uint64_t page = 1ULL<<(((w->addr+a)&0xFFFF)>>MEM_PAGE_SHIFT);
+            if (w->dir & ZX_IO_RD) dbg->watch_rd |= page;
+            if (w->dir & ZX_IO_WR) dbg->watch_wr |= page;
+        }
+        // The last page, when the range is not page aligned.
+        const uint64_t last = 1ULL<<(((w->addr+w->len-1)&0xFFFF)>>MEM_PAGE_SHIFT);
+        if (w->dir & ZX_IO_RD) dbg->watch_rd |= last;
+        if (w->dir & ZX_IO_WR) dbg->watch_wr |= last;
+    }
+    dbg->active = dbg->breakpoints || dbg->watches || dbg->step ||
+                  dbg->stop != ZX_DEBUG_RUNNING;
+}
+
+void zx_debug_break(zx_t* sys, uint16_t addr, bool set) {
+    CHIPS_ASSERT(sys && sys->valid);
+    zx_debug_t* dbg = &sys->debug;
+    const uint8_t bit = 1<<(addr&7);
+    if (set && !(dbg->pc_break[addr>>3] & bit)) {
+        dbg->pc_break[addr>>3] |= bit;
+        dbg->breakpoints++;
+    } else if (!set && (dbg->pc_break[addr>>3] & bit)) {
+        dbg->pc_break[addr>>3] &= ~bit;
+        dbg->breakpoints--;
+    }
+    _zx_debug_update(sys);
+}
+
+bool zx_debug_watch(zx_t* sys, uint16_t addr, uint16_t len, uint8_t dir) {
+    CHIPS_ASSERT(sys && sys->valid);
+    zx_debug_t* dbg = &sys->debug;
+    if (len == 0 || !(dir & (ZX_IO_RD|ZX_IO_WR))) return false;
+    if (dbg->watches == ZX_DEBUG_MAX_WATCH) return false;
+    zx_watch_t* w = &dbg->watch[dbg->watches++];
+    w->addr = addr;
+    w->len = len;
+    w->dir = dir;
+    _zx_debug_update(sys);
+    return true;
+}
+
+void zx_debug_unwatch(zx_t* sys, uint16_t addr) {
+    CHIPS_ASSERT(sys && sys->valid);
+    zx_debug_t* dbg = &sys->debug;
+    uint32_t kept = 0;
+    for (uint32_t j = 0; j < dbg->watches; j++)
+        if (dbg->watch[j].addr != addr) dbg->watch[kept++] = dbg->watch[j];
+    dbg->watches = kept;
+    _zx_debug_update(sys);
+}
+
+void zx_debug_clear(zx_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    zx_debug_t* dbg = &sys->debug;
+    memset(dbg->pc_break, 0, sizeof(dbg->pc_break));
+    dbg->breakpoints = 0;
+    dbg->watches = 0;
+    _zx_debug_update(sys);
+}
+
+void zx_debug_continue(zx_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->debug.stop = ZX_DEBUG_RUNNING;
+    sys->debug.step = false;
+    _zx_debug_update(sys);
+}
+
+void zx_debug_step(zx_t* sys) {
+    CHIPS_ASSERT(sys && sys->valid);
+    sys->debug.stop = ZX_DEBUG_RUNNING;
+    sys->debug.step = true;
+    _zx_debug_update(sys);
+}
+#endif
+
 void zx_key_down(zx_t* sys, int key_code) {
     CHIPS_ASSERT(sys && sys->valid);
     switch (sys->joystick_type) {
@@ -899,10 +1316,12 @@ bool zx_load_snapshot(zx_t* sys, uint32_t version, zx_t* src) {
     if (version != ZX_SNAPSHOT_VERSION) {
         return false;
     }
-    static zx_t im;
-    im = *src;
-    mem_snapshot_onload(&im.mem, sys);
-    *sys = im;
+    // Restore in place: no static copy, so that multiple instances
+    // can be used concurrently.
+    if (sys != src) {
+        *sys = *src;
+    }
+    mem_snapshot_onload(&sys->mem, sys);
     return true;
 }
 